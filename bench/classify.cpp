@@ -0,0 +1,143 @@
+// Compares the scalar batch classifier with the per-frame parse path used by
+// the stack, for burst sizes from 8 to 256 frames.
+#include "net/arp.h"
+#include "net/classify.h"
+#include "net/ethernet.h"
+#include "net/ipv4.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace classify = net::ethernet::classify;
+
+static constexpr uint32_t LOCAL_IP = 0x0A0A0A05;
+static constexpr uint32_t REMOTE_IP = 0x0A0A0B07;
+
+static std::vector<uint8_t> make_ipv4(uint32_t destination, uint8_t protocol,
+                                      uint16_t fragment_offset) {
+  std::vector<uint8_t> payload(56, 0xab);
+  auto header = net::ethernet::ipv4::Header();
+  header.internet_header_length = 5;
+  header.version = 4;
+  header.protocol = net::ethernet::ipv4::protocol_from_u8(protocol);
+  header.time_to_live = 64;
+  header.source = 0x0A0A0A02;
+  header.destination = destination;
+  header.length = 20 + payload.size();
+
+  std::vector<uint8_t> packet, frame;
+  net::ethernet::ipv4::build(header, payload, packet);
+  packet[9] = protocol;
+  packet[6] = (fragment_offset >> 8) & 0x1f;
+  packet[7] = fragment_offset & 0xff;
+  packet[10] = packet[11] = 0;
+  auto checksum =
+      net::ethernet::ipv4::htons(net::ethernet::ipv4::calculate_checksum(
+          std::span<const uint8_t>(packet).first(20)));
+  packet[10] = (checksum >> 8) & 0xff;
+  packet[11] = checksum & 0xff;
+
+  auto ethernet_header = net::ethernet::Header();
+  ethernet_header.type = net::ethernet::PacketType::IPv4;
+  net::ethernet::build(ethernet_header, packet, frame);
+  return frame;
+}
+
+static std::vector<uint8_t> make_arp() {
+  auto header = net::ethernet::arp::Header();
+  header.hardware_type = 1;
+  header.protocol_type = 0x0800;
+  header.hardware_length = 6;
+  header.protocol_length = 4;
+  header.opcode = 1;
+  header.source_ip = 0x0A0A0A02;
+  header.destination_ip = LOCAL_IP;
+
+  std::vector<uint8_t> packet, frame;
+  net::ethernet::arp::build(header, packet);
+  auto ethernet_header = net::ethernet::Header();
+  ethernet_header.type = net::ethernet::PacketType::ARP;
+  net::ethernet::build(ethernet_header, packet, frame);
+  return frame;
+}
+
+// The path the stack took before batching, reduced to picking a class.
+static void classify_parse(std::span<const std::span<const uint8_t>> frames,
+                           classify::Result &out) {
+  out.clear(frames.size());
+  for (std::size_t i = 0; i < frames.size(); i++) {
+    auto type = classify::Class::Drop;
+    std::span<const uint8_t> packet;
+    auto ethernet_header = net::ethernet::parse(frames[i], packet);
+    if (ethernet_header &&
+        ethernet_header->type == net::ethernet::PacketType::ARP) {
+      if (net::ethernet::arp::parse(packet))
+        type = classify::Class::ARP;
+    } else if (ethernet_header &&
+               ethernet_header->type == net::ethernet::PacketType::IPv4) {
+      std::span<const uint8_t> data;
+      auto ipv4_header = net::ethernet::ipv4::parse(packet, data);
+      if (ipv4_header && ipv4_header->destination != LOCAL_IP)
+        type = classify::Class::Forward;
+      else if (ipv4_header && (ipv4_header->flags & 1 ||
+                               ipv4_header->fragment_offset))
+        type = classify::Class::Fragment;
+      else if (ipv4_header && ipv4_header->protocol ==
+                                  net::ethernet::ipv4::Protocol::ICMP)
+        type = classify::Class::ICMP;
+      else if (ipv4_header)
+        type = classify::Class::Local;
+    }
+    out.indices[static_cast<std::size_t>(type)].push_back(i);
+  }
+}
+
+template <typename F> static double measure(std::size_t frames, F &&f) {
+  constexpr std::size_t TOTAL = 4'000'000;
+  auto rounds = TOTAL / frames;
+  f(); // warm up
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < rounds; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / (rounds * frames);
+}
+
+int main() {
+  std::mt19937 rng(42);
+  std::vector<std::vector<uint8_t>> kinds = {
+      make_arp(),
+      make_ipv4(LOCAL_IP, 0x01, 0),
+      make_ipv4(LOCAL_IP, 0x11, 0),
+      make_ipv4(LOCAL_IP, 0x01, 0x2000 >> 3),
+      make_ipv4(REMOTE_IP, 0x01, 0),
+      std::vector<uint8_t>(20, 0),
+  };
+  std::discrete_distribution<std::size_t> mix({10, 60, 5, 5, 15, 5});
+
+  std::vector<uint32_t> local = {LOCAL_IP};
+  classify::Result result;
+
+  std::printf("%6s %14s %15s %8s\n", "burst", "parse ns/frame",
+              "scalar ns/frame", "speedup");
+  for (std::size_t burst = 8; burst <= 256; burst *= 2) {
+    std::vector<std::vector<uint8_t>> buffers(burst);
+    for (auto &buffer : buffers) {
+      buffer = kinds[mix(rng)];
+    }
+    std::vector<std::span<const uint8_t>> frames(buffers.begin(),
+                                                 buffers.end());
+
+    auto parse = measure(burst, [&] { classify_parse(frames, result); });
+    auto scalar = measure(burst, [&] {
+      result.clear(frames.size());
+      classify::classify_scalar(frames, local, result);
+    });
+    std::printf("%6zu %14.2f %15.2f %7.2fx\n", burst, parse, scalar,
+                parse / scalar);
+  }
+  return 0;
+}
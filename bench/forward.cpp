@@ -0,0 +1,95 @@
+// Measures IPv4 forwarding between two in-process interfaces: frames are
+// injected on one loopback link, routed by the stack and drained from the
+// other, recycling the same buffers.
+#include "loopback.h"
+#include "net/ethernet.h"
+#include "net/ipv4.h"
+#include "stack.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+static constexpr uint32_t SOURCE_IP = 0x0A000002;      // 10.0.0.2
+static constexpr uint32_t DESTINATION_IP = 0x0A000102; // 10.0.1.2
+static constexpr std::array<uint8_t, 6> ROUTER_MAC = {0x02, 0, 0, 0, 0, 0x10};
+
+static std::vector<uint8_t> make_frame(std::size_t payload_size) {
+  std::vector<uint8_t> payload(payload_size, 0xab);
+  auto header = net::ethernet::ipv4::Header();
+  header.internet_header_length = 5;
+  header.version = 4;
+  header.protocol = net::ethernet::ipv4::protocol_from_u8(0x11);
+  header.time_to_live = 64;
+  header.source = SOURCE_IP;
+  header.destination = DESTINATION_IP;
+  header.length = 20 + payload.size();
+
+  std::vector<uint8_t> packet, frame;
+  net::ethernet::ipv4::build(header, payload, packet);
+
+  auto ethernet_header = net::ethernet::Header();
+  ethernet_header.type = net::ethernet::PacketType::IPv4;
+  ethernet_header.src_mac = {0x02, 0, 0, 0, 0, 0x01};
+  ethernet_header.dst_mac = ROUTER_MAC;
+  net::ethernet::build(ethernet_header, packet, frame);
+  return frame;
+}
+
+int main() {
+  constexpr std::size_t FRAMES = 2'000'000;
+  constexpr std::size_t HEADER = 14 + 20;
+
+  std::printf("%6s %8s %12s %10s\n", "burst", "payload", "pps", "ns/frame");
+  for (std::size_t payload : {64, 1400}) {
+    for (std::size_t burst = 8; burst <= 256; burst *= 2) {
+      auto [host0, router0] = LoopbackLink::create_pair("fwd0", burst);
+      auto [host1, router1] = LoopbackLink::create_pair("fwd1", burst);
+
+      Stack stack;
+      auto mac1 = ROUTER_MAC;
+      mac1[5]++;
+      stack.add_interface(*router0, 0x0A000001, 24, ROUTER_MAC);
+      stack.add_interface(*router1, 0x0A000101, 24, mac1);
+      stack.add_neighbor(DESTINATION_IP, {0x02, 0, 0, 0, 0, 0x02});
+      stack.set_forwarding(true);
+
+      auto original = make_frame(payload);
+      std::vector<std::vector<uint8_t>> pool(burst, original);
+      std::vector<std::vector<uint8_t>> buffers(burst);
+
+      std::size_t forwarded = 0;
+      auto start = std::chrono::steady_clock::now();
+      while (forwarded < FRAMES) {
+        for (auto &frame : pool) {
+          host0->transmit(std::move(frame));
+        }
+
+        std::size_t count = 0;
+        while (count < burst && router0->try_read(buffers[count])) {
+          count++;
+        }
+        stack.handle_burst(0, {buffers.data(), count});
+
+        // Restore the rewritten headers so the buffers can be sent again.
+        std::size_t drained = 0;
+        while (drained < burst && host1->try_read(pool[drained])) {
+          std::copy_n(original.begin(), HEADER, pool[drained].begin());
+          drained++;
+        }
+        if (drained != burst) {
+          std::fprintf(stderr, "lost %zu frames\n", burst - drained);
+          return 1;
+        }
+        forwarded += drained;
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      std::printf("%6zu %8zu %12.0f %10.1f\n", burst, payload,
+                  forwarded / elapsed.count(),
+                  elapsed.count() * 1e9 / forwarded);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A link is anything the stack can exchange ethernet frames with (a TAP
+// device, an in-process loopback, ...).
+class Link {
+public:
+  virtual ~Link() = default;
+
+  virtual std::string get_name() const = 0;
+
+  // The largest IPv4 packet the link carries, without the ethernet header.
+  virtual int get_mtu() const { return 1500; }
+
+  // Blocks until a frame is available.
+  virtual std::size_t read(std::vector<uint8_t> &buffer) = 0;
+  virtual std::size_t write(const std::vector<uint8_t> &buffer) = 0;
+
+  // Writes a frame the link may take ownership of, so backends that keep
+  // frames in memory can pass the buffer on instead of copying it.
+  virtual std::size_t transmit(std::vector<uint8_t> &&buffer) {
+    return write(buffer);
+  }
+
+  // Reads a frame if one is available without blocking; returns 0 otherwise.
+  virtual std::size_t try_read(std::vector<uint8_t> &buffer) = 0;
+
+  // Waits up to `timeout` for a frame; returns true if one can be read.
+  virtual bool wait(std::chrono::milliseconds timeout) = 0;
+
+  // A descriptor that polls readable while frames may be available, so
+  // several links can be waited on at once.
+  virtual int get_fd() const = 0;
+};
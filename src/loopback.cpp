@@ -0,0 +1,105 @@
+#include "loopback.h"
+#include "log.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+LoopbackLink::Queue::Queue(std::size_t capacity) : capacity(capacity) {
+  event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    throw std::runtime_error("eventfd failed: " +
+                             std::string(::strerror(errno)));
+  }
+}
+
+LoopbackLink::Queue::~Queue() { ::close(event_fd); }
+
+std::size_t LoopbackLink::Queue::push(std::vector<uint8_t> &&frame) {
+  auto size = frame.size();
+  {
+    std::lock_guard lock(mutex);
+    if (closed || frames.size() >= capacity) {
+      return 0;
+    }
+    frames.push_back(std::move(frame));
+    if (frames.size() == 1) {
+      uint64_t one = 1;
+      [[maybe_unused]] auto n = ::write(event_fd, &one, sizeof(one));
+    }
+  }
+  cv.notify_one();
+  return size;
+}
+
+LoopbackLink::LoopbackLink(std::string name, std::shared_ptr<Queue> rx,
+                           std::shared_ptr<Queue> tx)
+    : _name(std::move(name)), _rx(std::move(rx)), _tx(std::move(tx)) {}
+
+std::pair<std::unique_ptr<LoopbackLink>, std::unique_ptr<LoopbackLink>>
+LoopbackLink::create_pair(const std::string &name, std::size_t capacity) {
+  auto a_to_b = std::make_shared<Queue>(capacity);
+  auto b_to_a = std::make_shared<Queue>(capacity);
+
+  std::unique_ptr<LoopbackLink> a(new LoopbackLink(name + "a", b_to_a, a_to_b));
+  std::unique_ptr<LoopbackLink> b(new LoopbackLink(name + "b", a_to_b, b_to_a));
+  LOG_DEBUG("Loopback pair {} created (capacity {})", name, capacity);
+  return {std::move(a), std::move(b)};
+}
+
+std::string LoopbackLink::get_name() const { return _name; }
+
+std::size_t LoopbackLink::read(std::vector<uint8_t> &buffer) {
+  std::unique_lock lock(_rx->mutex);
+  _rx->cv.wait(lock, [this] { return !_rx->frames.empty() || _rx->closed; });
+  if (_rx->frames.empty()) {
+    buffer.clear();
+    return 0;
+  }
+
+  buffer = std::move(_rx->frames.front());
+  _rx->frames.pop_front();
+  return buffer.size();
+}
+
+std::size_t LoopbackLink::try_read(std::vector<uint8_t> &buffer) {
+  std::lock_guard lock(_rx->mutex);
+  if (_rx->frames.empty()) {
+    uint64_t count;
+    [[maybe_unused]] auto n = ::read(_rx->event_fd, &count, sizeof(count));
+    buffer.clear();
+    return 0;
+  }
+
+  buffer = std::move(_rx->frames.front());
+  _rx->frames.pop_front();
+  return buffer.size();
+}
+
+std::size_t LoopbackLink::write(const std::vector<uint8_t> &buffer) {
+  return _tx->push(std::vector<uint8_t>(buffer));
+}
+
+std::size_t LoopbackLink::transmit(std::vector<uint8_t> &&buffer) {
+  return _tx->push(std::move(buffer));
+}
+
+bool LoopbackLink::wait(std::chrono::milliseconds timeout) {
+  std::unique_lock lock(_rx->mutex);
+  return _rx->cv.wait_for(lock, timeout, [this] {
+    return !_rx->frames.empty() || _rx->closed;
+  });
+}
+
+int LoopbackLink::get_fd() const { return _rx->event_fd; }
+
+void LoopbackLink::close() {
+  for (auto &queue : {_rx, _tx}) {
+    {
+      std::lock_guard lock(queue->mutex);
+      queue->closed = true;
+    }
+    queue->cv.notify_all();
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "link.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// In-process link. Endpoints are created in connected pairs: frames written
+// to one end are read from the other. Each direction is a bounded queue and
+// frames written to a full queue are dropped, like a NIC ring.
+class LoopbackLink : public Link {
+public:
+  static std::pair<std::unique_ptr<LoopbackLink>, std::unique_ptr<LoopbackLink>>
+  create_pair(const std::string &name, std::size_t capacity = 4096);
+
+  std::string get_name() const override;
+
+  // Returns 0 once the link has been closed and drained.
+  std::size_t read(std::vector<uint8_t> &buffer) override;
+  // Returns 0 if the frame was dropped.
+  std::size_t write(const std::vector<uint8_t> &buffer) override;
+  std::size_t transmit(std::vector<uint8_t> &&buffer) override;
+  std::size_t try_read(std::vector<uint8_t> &buffer) override;
+  bool wait(std::chrono::milliseconds timeout) override;
+  // An eventfd that is signalled on writes and reset once the queue is found
+  // empty.
+  int get_fd() const override;
+
+  // Wakes up readers on both ends; subsequent writes are dropped.
+  void close();
+
+private:
+  struct Queue {
+    Queue(std::size_t capacity);
+    ~Queue();
+
+    std::size_t push(std::vector<uint8_t> &&frame);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> frames;
+    std::size_t capacity;
+    bool closed{false};
+    int event_fd{-1};
+  };
+
+  LoopbackLink(std::string name, std::shared_ptr<Queue> rx,
+               std::shared_ptr<Queue> tx);
+
+  std::string _name;
+  std::shared_ptr<Queue> _rx;
+  std::shared_ptr<Queue> _tx;
+};
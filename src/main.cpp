@@ -1,169 +1,405 @@
 #include "log.h"
-#include "net/arp.h"
-#include "net/ethernet.h"
-#include "net/icmp.h"
+#include "loopback.h"
 #include "net/ipv4.h"
+#include "pktgen.h"
+#include "poller.h"
+#include "recorder.h"
+#include "shm.h"
+#include "stack.h"
 #include "tun.h"
+#include <algorithm>
+#include <atomic>
 #include <csignal>
+#include <cstdio>
 #include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-static bool running = true;
+static std::atomic<bool> running = true;
 void signal_handler(int) { running = false; }
 
-int main() {
-  signal(SIGINT, signal_handler);
-  uint32_t ip_address = 0x0A0A0A05;
-  std::array<uint8_t, 6> mac = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
-  TunDevice tap("tap69", 1500);
-  std::vector<uint8_t> frame, reply;
+static uint64_t parse_number(std::string_view value) {
+  std::size_t end = 0;
+  auto number = std::stoull(std::string(value), &end);
+  if (end != value.size()) {
+    throw std::invalid_argument(std::format("invalid number: {}", value));
+  }
+  return number;
+}
 
-  try {
-    tap.open();
-    LOG_INFO("TAP interface {} created", tap.get_name());
+// Parses `arp:1,echo:8,bad-checksum:1,truncated:1`.
+static TrafficMix parse_mix(std::string_view value) {
+  TrafficMix mix{0, 0, 0, 0};
+  while (!value.empty()) {
+    auto comma = value.find(',');
+    auto item = value.substr(0, comma);
+    value = comma == std::string_view::npos ? "" : value.substr(comma + 1);
 
-    while (running) {
-      auto n = tap.read(frame);
-      LOG_INFO("Read {} bytes", n);
+    auto colon = item.find(':');
+    if (colon == std::string_view::npos) {
+      throw std::invalid_argument(std::format("invalid mix entry: {}", item));
+    }
+    auto kind = item.substr(0, colon);
+    auto weight = static_cast<unsigned>(parse_number(item.substr(colon + 1)));
+    if (kind == "arp")
+      mix.arp = weight;
+    else if (kind == "echo")
+      mix.echo = weight;
+    else if (kind == "bad-checksum")
+      mix.bad_checksum = weight;
+    else if (kind == "truncated")
+      mix.truncated = weight;
+    else
+      throw std::invalid_argument(std::format("unknown frame kind: {}", kind));
+  }
+  return mix;
+}
 
-      std::span<const uint8_t> packet;
-      auto ethernet_header = net::ethernet::parse(frame, packet);
+// Parses `2,3` into a list of CPU numbers.
+static std::vector<int> parse_cpus(std::string_view value) {
+  std::vector<int> cpus;
+  while (!value.empty()) {
+    auto comma = value.find(',');
+    cpus.push_back(static_cast<int>(parse_number(value.substr(0, comma))));
+    value = comma == std::string_view::npos ? "" : value.substr(comma + 1);
+  }
+  return cpus;
+}
 
-      if (!ethernet_header)
-        continue;
+// Parses a dotted quad into a host byte order address.
+static uint32_t parse_ip(std::string_view value) {
+  uint32_t address = 0;
+  auto rest = value;
+  for (int i = 0; i < 4; i++) {
+    auto dot = rest.find('.');
+    if ((dot == std::string_view::npos) != (i == 3)) {
+      throw std::invalid_argument(std::format("invalid address: {}", value));
+    }
 
-      LOG_INFO("Ethernet packet received");
-      LOG_DEBUG("Ethernet Header: {}", ethernet_header->to_string());
+    auto octet = rest.substr(0, dot);
+    if (octet.empty() || octet.size() > 3 ||
+        !std::all_of(octet.begin(), octet.end(),
+                     [](char c) { return c >= '0' && c <= '9'; }) ||
+        parse_number(octet) > 255) {
+      throw std::invalid_argument(std::format("invalid address: {}", value));
+    }
+    address = (address << 8) | parse_number(octet);
+    rest = dot == std::string_view::npos ? "" : rest.substr(dot + 1);
+  }
+  return address;
+}
 
-      switch (ethernet_header->type) {
-      case net::ethernet::PacketType::ARP: {
-        auto arp_header = net::ethernet::arp::parse(packet);
-        if (!arp_header) {
-          continue;
-        }
+// Parses `10.10.10.5/24`.
+static std::pair<uint32_t, uint8_t> parse_prefix(std::string_view value) {
+  auto slash = value.find('/');
+  if (slash == std::string_view::npos) {
+    throw std::invalid_argument(
+        std::format("missing prefix length: {}", value));
+  }
 
-        LOG_INFO("ARP packet received");
-        LOG_DEBUG("ARP Header: {}", arp_header->to_string());
+  auto prefix_length = parse_number(value.substr(slash + 1));
+  if (prefix_length > 32) {
+    throw std::invalid_argument(std::format("invalid prefix: {}", value));
+  }
+  return {parse_ip(value.substr(0, slash)),
+          static_cast<uint8_t>(prefix_length)};
+}
 
-        if (arp_header->opcode != 1 ||
-            arp_header->destination_ip != ip_address) {
-          continue;
-        }
+// Splits `a,b,c` into its fields.
+static std::vector<std::string_view> split(std::string_view value) {
+  std::vector<std::string_view> fields;
+  while (true) {
+    auto comma = value.find(',');
+    fields.push_back(value.substr(0, comma));
+    if (comma == std::string_view::npos)
+      return fields;
+    value = value.substr(comma + 1);
+  }
+}
+
+struct InterfaceOption {
+  std::string name;
+  uint32_t ip_address;
+  uint8_t prefix_length;
+  // Address of the host side of the TAP device.
+  uint32_t host_address;
+};
+
+struct RouteOption {
+  uint32_t network;
+  uint8_t prefix_length;
+  uint32_t gateway;
+};
+
+struct Options {
+  bool pktgen{false};
+  bool attach{false};
+  bool forward{false};
+  bool echo{false};
+  std::vector<InterfaceOption> interfaces;
+  std::vector<RouteOption> routes;
+  std::string flight_recorder{"tcp_ip.flight"};
+  std::string shm_socket;
+  shm::Registration registration{};
+  TrafficConfig traffic;
+  PollConfig poll;
+};
+
+static Options parse_options(int argc, char **argv) {
+  Options options;
+  int i = 1;
+  // The pktgen binary is this one built with quiet logging.
+  if (std::string_view(argv[0]).ends_with("pktgen")) {
+    options.pktgen = true;
+  } else if (argc > 1 && std::string_view(argv[1]) == "pktgen") {
+    options.pktgen = true;
+    i++;
+  } else if (argc > 1 && std::string_view(argv[1]) == "attach") {
+    options.attach = true;
+    i++;
+  }
+
+  auto &config = options.traffic;
+  for (; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto equals = arg.find('=');
+    auto name = arg.substr(0, equals);
+    auto value = equals == std::string_view::npos ? std::string_view()
+                                                  : arg.substr(equals + 1);
 
-        auto reply_header = net::ethernet::arp::Header();
-        reply_header.hardware_type = 0x0001;
-        reply_header.protocol_type = 0x0800;
-        reply_header.hardware_length = 0x06;
-        reply_header.protocol_length = 0x04;
-        reply_header.opcode = 0x02;
-        reply_header.source_mac_address = mac;
-        reply_header.source_ip = arp_header->destination_ip;
-        reply_header.destination_mac_address = arp_header->source_mac_address;
-        reply_header.destination_ip = arp_header->source_ip;
-        LOG_DEBUG("ARP reply: {}", reply_header.to_string());
-
-        std::vector<uint8_t> reply_arp_packet;
-        net::ethernet::arp::build(reply_header, reply_arp_packet);
-        LOG_TRACE("Successfully built ARP reply (size {})",
-                  reply_arp_packet.size());
-
-        auto reply_ethernet_header = net::ethernet::Header();
-        reply_ethernet_header.type = net::ethernet::PacketType::ARP;
-        reply_ethernet_header.src_mac = mac;
-        reply_ethernet_header.dst_mac = ethernet_header->src_mac;
-        LOG_DEBUG("ARP reply ethernet: {}", reply_ethernet_header.to_string());
-
-        net::ethernet::build(reply_ethernet_header, reply_arp_packet, reply);
-        LOG_TRACE("Successfully built ARP ethernet reply (size {})",
-                  reply.size());
-        n = tap.write(reply);
-        LOG_DEBUG("Successfully sent ARP reply: {}", n);
-
-        break;
+    if (name == "--count") {
+      config.count = parse_number(value);
+    } else if (name == "--rate") {
+      config.rate = parse_number(value);
+    } else if (name == "--mix") {
+      config.mix = parse_mix(value);
+    } else if (name == "--payload") {
+      auto dash = value.find('-');
+      config.min_payload = parse_number(value.substr(0, dash));
+      config.max_payload = dash == std::string_view::npos
+                               ? config.min_payload
+                               : parse_number(value.substr(dash + 1));
+    } else if (name == "--drain-ms") {
+      config.drain = std::chrono::milliseconds(parse_number(value));
+    } else if (name == "--poll") {
+      if (value == "busy")
+        options.poll.mode = PollConfig::Mode::Busy;
+      else if (value == "blocking")
+        options.poll.mode = PollConfig::Mode::Blocking;
+      else
+        throw std::invalid_argument(
+            std::format("unknown poll mode: {}", value));
+    } else if (name == "--spin-us") {
+      options.poll.spin = std::chrono::microseconds(parse_number(value));
+    } else if (name == "--burst") {
+      options.poll.burst = parse_number(value);
+      if (options.poll.burst == 0 ||
+          options.poll.burst > net::ethernet::classify::MAX_BURST) {
+        throw std::invalid_argument(std::format(
+            "burst must be 1 to {}", net::ethernet::classify::MAX_BURST));
       }
-      case net::ethernet::PacketType::IPv4: {
-        std::span<const uint8_t> ipv4_data;
-        auto ipv4_header = net::ethernet::ipv4::parse(packet, ipv4_data);
-        if (ipv4_header) {
-          LOG_INFO("IPv4 packet received");
-          LOG_DEBUG("IPv4 Header: {}", ipv4_header->to_string());
-          switch (ipv4_header->protocol) {
-          case net::ethernet::ipv4::Protocol::ICMP: {
-            std::span<const uint8_t> icmp_data;
-
-            auto icmp_header =
-                net::ethernet::ipv4::icmp::parse(ipv4_data, icmp_data);
-            if (!icmp_header) {
-              continue;
-            }
-
-            LOG_INFO("ICMP packet received");
-            LOG_DEBUG("ICMP Header: {}", icmp_header->to_string());
-
-            auto icmp_reply_header = net::ethernet::ipv4::icmp::Header();
-            icmp_reply_header.type =
-                net::ethernet::ipv4::icmp::PacketType::Reply;
-            icmp_reply_header.code = 0;
-            icmp_reply_header.identifier = icmp_header->identifier;
-            icmp_reply_header.sequence_number = icmp_header->sequence_number;
-            icmp_reply_header.checksum = 0;
-
-            std::vector<uint8_t> icmp_reply_packet;
-            net::ethernet::ipv4::icmp::build(icmp_reply_header, icmp_data,
-                                             icmp_reply_packet);
-            LOG_DEBUG("ICMP reply: {}", icmp_reply_header.to_string());
-
-            auto ipv4_reply_header = net::ethernet::ipv4::Header();
-            ipv4_reply_header.internet_header_length = 5;
-            ipv4_reply_header.version = 4;
-            ipv4_reply_header.protocol = net::ethernet::ipv4::Protocol::ICMP;
-            ipv4_reply_header.type_of_service = 0;
-            ipv4_reply_header.identification = ipv4_header->identification + 1;
-            ipv4_reply_header.flags = 0;
-            ipv4_reply_header.fragment_offset = 0;
-            ipv4_reply_header.time_to_live = 64;
-            ipv4_reply_header.source = ip_address;
-            ipv4_reply_header.destination = ipv4_header->source;
-            ipv4_reply_header.length = 20 + icmp_reply_packet.size();
-            ipv4_reply_header.checksum = 0;
-
-            std::vector<uint8_t> ipv4_reply_packet;
-            net::ethernet::ipv4::build(ipv4_reply_header, icmp_reply_packet,
-                                       ipv4_reply_packet);
-            LOG_DEBUG("IPv4 reply: {}", ipv4_reply_header.to_string());
-
-            auto ethernet_reply_header = net::ethernet::Header();
-            ethernet_reply_header.type = net::ethernet::PacketType::IPv4;
-            ethernet_reply_header.src_mac = mac;
-            ethernet_reply_header.dst_mac = ethernet_header->src_mac;
-
-            net::ethernet::build(ethernet_reply_header, ipv4_reply_packet,
-                                 reply);
-            LOG_DEBUG("Ethernet reply: {}", ethernet_reply_header.to_string());
-
-            tap.write(reply);
-            break;
-          }
-          default:
-            LOG_WARN(
-                "IPv4 protocol {} not supported",
-                net::ethernet::ipv4::protocol_to_string(ipv4_header->protocol));
-            break;
-          }
+    } else if (name == "--cpus") {
+      options.poll.cpus = parse_cpus(value);
+    } else if (name == "--flight-recorder") {
+      options.flight_recorder = value;
+    } else if (name == "--if") {
+      // NAME,IP/PREFIX,HOST_IP
+      auto fields = split(value);
+      if (fields.size() != 3) {
+        throw std::invalid_argument(
+            std::format("invalid interface: {}", value));
+      }
+      auto [ip_address, prefix_length] = parse_prefix(fields[1]);
+      options.interfaces.push_back({std::string(fields[0]), ip_address,
+                                    prefix_length, parse_ip(fields[2])});
+    } else if (name == "--route") {
+      // NETWORK/PREFIX,GATEWAY
+      auto fields = split(value);
+      if (fields.size() != 2) {
+        throw std::invalid_argument(std::format("invalid route: {}", value));
+      }
+      auto [network, prefix_length] = parse_prefix(fields[0]);
+      options.routes.push_back({network, prefix_length, parse_ip(fields[1])});
+    } else if (name == "--forward") {
+      options.forward = true;
+    } else if (name == "--shm-socket") {
+      options.shm_socket = value;
+    } else if (name == "--ip") {
+      options.registration.ip = parse_ip(value);
+    } else if (name == "--protocol") {
+      if (value == "icmp")
+        options.registration.protocol = 0x01;
+      else if (value == "tcp")
+        options.registration.protocol = 0x06;
+      else if (value == "udp")
+        options.registration.protocol = 0x11;
+      else
+        options.registration.protocol =
+            static_cast<uint8_t>(parse_number(value));
+    } else if (name == "--port") {
+      options.registration.port = static_cast<uint16_t>(parse_number(value));
+    } else if (name == "--echo") {
+      options.echo = true;
+    } else {
+      throw std::invalid_argument(std::format("unknown option: {}", arg));
+    }
+  }
+  return options;
+}
+
+// Runs the stack against the traffic generator over an in-process link.
+static int pktgen(const Options &options, uint32_t ip_address,
+                  std::array<uint8_t, 6> mac) {
+  auto config = options.traffic;
+  config.target_ip = ip_address;
+  config.target_mac = mac;
+
+  auto [generator_link, stack_link] = LoopbackLink::create_pair("pktgen");
+  Stack stack;
+  stack.add_interface(*stack_link, ip_address, 24, mac);
+  Poller poller(options.poll);
+  std::thread worker([&] {
+    try {
+      poller.run(stack, running);
+    } catch (const std::exception &e) {
+      LOG_ERROR("{}", e.what());
+    }
+  });
+
+  TrafficGenerator generator(config);
+  auto report = generator.run(*generator_link);
+
+  running = false;
+  stack_link->close();
+  worker.join();
+
+  // Printed whatever the log level, as pktgen is built to log warnings only.
+  std::printf("%s\n%s\n", report.to_string().c_str(),
+              poller.stats().to_string().c_str());
+  return 0;
+}
+
+// Reference application: logs what the stack delivers over shared memory and,
+// with --echo, sends it back, swapping UDP ports.
+static int attach(const Options &options) {
+  if (options.shm_socket.empty()) {
+    throw std::invalid_argument("attach needs --shm-socket");
+  }
+
+  ShmClient client(options.shm_socket, options.registration);
+  LOG_INFO("Attached to {}", options.shm_socket);
+
+  uint64_t received = 0;
+  ShmClient::Packet packet;
+  while (running.load(std::memory_order_relaxed)) {
+    if (!client.receive(packet)) {
+      client.wait(std::chrono::milliseconds(100));
+      continue;
+    }
+
+    received++;
+    const auto &descriptor = packet.descriptor;
+    LOG_INFO("{} bytes from {} to {} (protocol {}, port {})",
+             packet.payload.size(),
+             net::ethernet::ipv4::ip_to_string(descriptor.peer),
+             net::ethernet::ipv4::ip_to_string(descriptor.local),
+             descriptor.protocol, descriptor.port);
+
+    if (options.echo) {
+      auto buffer = client.allocate();
+      if (!buffer.empty()) {
+        std::copy(packet.payload.begin(), packet.payload.end(),
+                  buffer.begin());
+        if (descriptor.protocol == 0x11 && packet.payload.size() >= 8) {
+          std::swap_ranges(buffer.begin(), buffer.begin() + 2,
+                           buffer.begin() + 2);
+          buffer[6] = buffer[7] = 0;
         }
-        break;
+        client.send(buffer, packet.payload.size(), descriptor.peer,
+                    descriptor.protocol);
       }
-      default:
-        LOG_WARN("Packet type {} not supported",
-                 net::ethernet::packet_type_to_string(ethernet_header->type));
-        break;
+    }
+    client.release(packet);
+  }
+
+  LOG_INFO("Received {} payload(s)", received);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGINT, signal_handler);
+  uint32_t ip_address = 0x0A0A0A05;
+  std::array<uint8_t, 6> mac = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+  try {
+    if (argc > 1 && std::string_view(argv[1]) == "flight2pcapng") {
+      if (argc != 4) {
+        throw std::invalid_argument("usage: flight2pcapng <dump> <pcapng>");
       }
+      recorder::convert(argv[2], argv[3]);
+      return 0;
+    }
+
+    auto options = parse_options(argc, argv);
+    // Applications record nothing, and must not overwrite the stack's dump.
+    if (options.attach) {
+      return attach(options);
+    }
+    recorder::install(options.flight_recorder);
+    if (options.pktgen) {
+      return pktgen(options, ip_address, mac);
+    }
+
+    if (options.interfaces.empty()) {
+      options.interfaces.push_back({"tap69", ip_address, 24, 0x0A0A0A01});
+    }
+
+    Stack stack;
+    std::vector<std::unique_ptr<TunDevice>> taps;
+    for (const auto &interface : options.interfaces) {
+      auto netmask =
+          net::ethernet::ipv4::prefix_to_netmask(interface.prefix_length);
+      auto network = std::format(
+          "{}/{}",
+          net::ethernet::ipv4::ip_to_string(interface.ip_address & netmask),
+          interface.prefix_length);
+
+      auto &tap = taps.emplace_back(std::make_unique<TunDevice>(
+          interface.name, 1500, network,
+          net::ethernet::ipv4::ip_to_string(interface.host_address)));
+      tap->open();
+      LOG_INFO("TAP interface {} created", tap->get_name());
+
+      auto interface_mac = mac;
+      interface_mac[5] += taps.size() - 1;
+      stack.add_interface(*tap, interface.ip_address, interface.prefix_length,
+                          interface_mac);
+    }
+    for (const auto &route : options.routes) {
+      stack.add_route(route.network, route.prefix_length, route.gateway);
+    }
+    stack.set_forwarding(options.forward);
+
+    std::unique_ptr<ShmServer> server;
+    if (!options.shm_socket.empty()) {
+      server = std::make_unique<ShmServer>(stack, options.shm_socket);
+      stack.attach(*server);
+    }
+
+    Poller poller(options.poll);
+    poller.run(stack, running, server.get());
+    LOG_INFO("{}", poller.stats().to_string());
+    for (const auto &tap : taps) {
+      LOG_INFO("TUN interface {} closed", tap->get_name());
     }
   } catch (const std::exception &e) {
     LOG_ERROR("{}", e.what());
     return -1;
   }
 
-  LOG_INFO("TUN interface {} closed", tap.get_name());
   return 0;
 }
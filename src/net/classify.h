@@ -0,0 +1,101 @@
+#pragma once
+
+#include "ethernet.h"
+#include "ipv4.h"
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Sorts a burst of received frames into per-class index lists, so handlers can
+// process each class in a tight loop. Only the fields needed to pick a handler
+// are looked at; handlers still fully parse (and checksum) what they get.
+namespace net::ethernet::classify {
+enum class Class : uint8_t {
+  ARP,
+  // IPv4 addressed to us, by protocol.
+  ICMP,
+  Local,
+  // IPv4 addressed to us with MF set or a non-zero fragment offset.
+  Fragment,
+  // IPv4 addressed to someone else.
+  Forward,
+  Drop,
+  Count,
+};
+
+inline constexpr std::size_t CLASS_COUNT =
+    static_cast<std::size_t>(Class::Count);
+
+struct Result {
+  std::array<std::vector<uint16_t>, CLASS_COUNT> indices;
+
+  std::span<const uint16_t> operator[](Class type) const {
+    return indices[static_cast<std::size_t>(type)];
+  }
+
+  void clear(std::size_t burst) {
+    for (auto &list : indices) {
+      list.clear();
+      list.reserve(burst);
+    }
+  }
+};
+
+// Frames are indexed with 16 bits.
+inline constexpr std::size_t MAX_BURST = 65536;
+
+// Minimum frame sizes for a class to be recognized: ethernet + ARP, and
+// ethernet + IPv4 up to and including the destination address.
+inline constexpr std::size_t ARP_FRAME_SIZE = 42;
+inline constexpr std::size_t IPV4_FRAME_SIZE = 34;
+
+inline Class classify_one(std::span<const uint8_t> frame,
+                          std::span<const uint32_t> local) {
+  if (frame.size() < IPV4_FRAME_SIZE) {
+    return Class::Drop;
+  }
+
+  uint16_t type = (frame[12] << 8) | frame[13];
+  if (type == 0x0806) {
+    return frame.size() >= ARP_FRAME_SIZE ? Class::ARP : Class::Drop;
+  }
+  if (type != 0x0800 || (frame[14] >> 4) != 4 || (frame[14] & 0x0f) < 5) {
+    return Class::Drop;
+  }
+
+  uint32_t destination =
+      (frame[30] << 24) | (frame[31] << 16) | (frame[32] << 8) | frame[33];
+  bool is_local = false;
+  for (auto address : local) {
+    is_local |= address == destination;
+  }
+  if (!is_local) {
+    return Class::Forward;
+  }
+  if ((frame[20] & 0x3f) | frame[21]) {
+    return Class::Fragment;
+  }
+  return frame[23] == 0x01 ? Class::ICMP : Class::Local;
+}
+
+inline void classify_scalar(std::span<const std::span<const uint8_t>> frames,
+                            std::span<const uint32_t> local, Result &out) {
+  for (std::size_t i = 0; i < frames.size(); i++) {
+    auto type = classify_one(frames[i], local);
+    out.indices[static_cast<std::size_t>(type)].push_back(
+        static_cast<uint16_t>(i));
+  }
+}
+
+// Classifies a burst of at most 65536 frames against the local addresses
+// (host byte order).
+inline void classify(std::span<const std::span<const uint8_t>> frames,
+                     std::span<const uint32_t> local, Result &out) {
+  assert(frames.size() <= MAX_BURST);
+  out.clear(frames.size());
+  classify_scalar(frames, local, out);
+}
+} // namespace net::ethernet::classify
@@ -11,7 +11,12 @@
 #include <vector>
 
 namespace net::ethernet::ipv4::icmp {
-enum class PacketType : uint8_t { Reply = 0x00, Echo = 0x08, Unknown = 0x00 };
+enum class PacketType : uint8_t {
+  Reply = 0x00,
+  Echo = 0x08,
+  TimeExceeded = 0x0B,
+  Unknown = 0x00
+};
 
 inline std::string type_to_string(PacketType type) {
   switch (type) {
@@ -19,6 +24,8 @@ inline std::string type_to_string(PacketType type) {
     return "Echo";
   case PacketType::Reply:
     return "Reply";
+  case PacketType::TimeExceeded:
+    return "TimeExceeded";
   default:
     return "Unknown";
   }
@@ -30,6 +37,8 @@ inline PacketType to_type(uint8_t type) {
     return PacketType::Echo;
   case 0x00:
     return PacketType::Reply;
+  case 0x0B:
+    return PacketType::TimeExceeded;
   default:
     return PacketType::Unknown;
   }
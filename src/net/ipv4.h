@@ -20,6 +20,10 @@ inline std::string ip_to_string(uint32_t ip) {
                      (ip >> 8) & 0xFF, ip & 0xFF);
 }
 
+inline uint32_t prefix_to_netmask(uint8_t prefix_length) {
+  return prefix_length ? ~uint32_t{0} << (32 - prefix_length) : 0;
+}
+
 enum class Protocol : uint8_t { ICMP = 0x01, Unknown = 0x00 };
 
 inline Protocol protocol_from_u8(uint8_t protocol) {
@@ -53,6 +57,18 @@ inline uint16_t calculate_checksum(std::span<const uint8_t> packet) {
   return static_cast<uint16_t>(~sum);
 }
 
+// Updates a checksum after one 16-bit word it covers changed from `old_word`
+// to `new_word` (RFC 1624), without summing the whole header again.
+inline uint16_t update_checksum(uint16_t checksum, uint16_t old_word,
+                                uint16_t new_word) {
+  uint32_t sum = static_cast<uint16_t>(~checksum) +
+                 static_cast<uint16_t>(~old_word) + new_word;
+  while (sum >> 16) {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+  return static_cast<uint16_t>(~sum);
+}
+
 #pragma pack(push, 1)
 struct Header {
   std::uint8_t version : 4;
@@ -110,12 +126,12 @@ inline std::optional<Header> parse(std::span<const uint8_t> packet,
   uint16_t checksum =
       calculate_checksum(packet.subspan(0, header.internet_header_length * 4));
   if (checksum != 0) {
-    LOG_WARN("Error in checksum calculation: {}", checksum);
+    LOG_DEBUG("Error in checksum calculation: {}", checksum);
     return std::nullopt;
   }
   if (packet.size() > header.length) {
-    LOG_WARN("Packet too large, size {} expected {}", packet.size(),
-             header.length);
+    LOG_DEBUG("Packet too large, size {} expected {}", packet.size(),
+              header.length);
     return std::nullopt;
   }
 
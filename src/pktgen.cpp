@@ -0,0 +1,280 @@
+#include "pktgen.h"
+#include "log.h"
+#include "net/arp.h"
+#include "net/ethernet.h"
+#include "net/icmp.h"
+#include "net/ipv4.h"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+constexpr std::size_t TEMPLATE_COUNT = 256;
+constexpr uint16_t ECHO_IDENTIFIER = 0x7067;
+constexpr std::array<uint8_t, 6> BROADCAST = {0xff, 0xff, 0xff,
+                                              0xff, 0xff, 0xff};
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::chrono::nanoseconds percentile(const std::vector<int64_t> &sorted,
+                                    double p) {
+  if (sorted.empty()) {
+    return std::chrono::nanoseconds(0);
+  }
+  auto index = static_cast<std::size_t>(p * (sorted.size() - 1));
+  return std::chrono::nanoseconds(sorted[index]);
+}
+} // namespace
+
+std::string TrafficReport::to_string() const {
+  return std::format(
+      "TrafficReport(sent={}, dropped={}, offered={}, expected={}, "
+      "received={}, unmatched={}, seconds={:.3f}, tx_pps={:.0f}, "
+      "rx_pps={:.0f}, loss={:.2f}%, stack_loss={:.2f}%, p50={}, p90={}, "
+      "p99={}, p99.9={}, max={})",
+      sent, dropped, offered, expected, received, unmatched, seconds, tx_pps,
+      rx_pps, loss * 100, stack_loss * 100, p50, p90, p99, p999, max);
+}
+
+TrafficGenerator::TrafficGenerator(TrafficConfig config)
+    : _config(config), _rng(std::random_device{}()) {
+  auto &mix = _config.mix;
+  if (mix.arp + mix.echo + mix.bad_checksum + mix.truncated == 0) {
+    throw std::invalid_argument("traffic mix is empty");
+  }
+  if (_config.min_payload > _config.max_payload) {
+    throw std::invalid_argument("min payload larger than max payload");
+  }
+
+  _templates.reserve(TEMPLATE_COUNT);
+  for (std::size_t i = 0; i < TEMPLATE_COUNT; i++) {
+    _templates.push_back(build_template(pick_kind()));
+  }
+}
+
+TrafficGenerator::Kind TrafficGenerator::pick_kind() {
+  auto &mix = _config.mix;
+  std::uniform_int_distribution<unsigned> dist(
+      0, mix.arp + mix.echo + mix.bad_checksum + mix.truncated - 1);
+  auto n = dist(_rng);
+  if (n < mix.arp)
+    return Kind::ARP;
+  n -= mix.arp;
+  if (n < mix.echo)
+    return Kind::Echo;
+  n -= mix.echo;
+  if (n < mix.bad_checksum)
+    return Kind::BadChecksum;
+  return Kind::Truncated;
+}
+
+TrafficGenerator::Template TrafficGenerator::build_template(Kind kind) {
+  std::array<uint8_t, 6> source_mac = {0x02, 0x70, 0x00, 0x00, 0x00, 0x00};
+  Template result{kind, {}};
+
+  if (kind == Kind::ARP) {
+    auto arp_header = net::ethernet::arp::Header();
+    arp_header.hardware_type = 0x0001;
+    arp_header.protocol_type = 0x0800;
+    arp_header.hardware_length = 0x06;
+    arp_header.protocol_length = 0x04;
+    arp_header.opcode = 0x01;
+    arp_header.source_mac_address = source_mac;
+    arp_header.source_ip = _config.source_ip;
+    arp_header.destination_mac_address = {};
+    arp_header.destination_ip = _config.target_ip;
+
+    std::vector<uint8_t> arp_packet;
+    net::ethernet::arp::build(arp_header, arp_packet);
+
+    auto ethernet_header = net::ethernet::Header();
+    ethernet_header.type = net::ethernet::PacketType::ARP;
+    ethernet_header.src_mac = source_mac;
+    ethernet_header.dst_mac = BROADCAST;
+    net::ethernet::build(ethernet_header, arp_packet, result.frame);
+    return result;
+  }
+
+  std::uniform_int_distribution<std::size_t> payload_size(_config.min_payload,
+                                                          _config.max_payload);
+  std::vector<uint8_t> payload(payload_size(_rng));
+  for (std::size_t i = 0; i < payload.size(); i++) {
+    payload[i] = static_cast<uint8_t>(i);
+  }
+
+  auto icmp_header = net::ethernet::ipv4::icmp::Header();
+  icmp_header.type = net::ethernet::ipv4::icmp::PacketType::Echo;
+  icmp_header.code = 0;
+  icmp_header.identifier = ECHO_IDENTIFIER;
+  icmp_header.sequence_number = static_cast<uint16_t>(_templates.size());
+  icmp_header.checksum = 0;
+
+  std::vector<uint8_t> icmp_packet;
+  net::ethernet::ipv4::icmp::build(icmp_header, payload, icmp_packet);
+
+  auto ipv4_header = net::ethernet::ipv4::Header();
+  ipv4_header.internet_header_length = 5;
+  ipv4_header.version = 4;
+  ipv4_header.protocol = net::ethernet::ipv4::Protocol::ICMP;
+  ipv4_header.type_of_service = 0;
+  ipv4_header.identification = static_cast<uint16_t>(_templates.size());
+  ipv4_header.flags = 0;
+  ipv4_header.fragment_offset = 0;
+  ipv4_header.time_to_live = 64;
+  ipv4_header.source = _config.source_ip;
+  ipv4_header.destination = _config.target_ip;
+  ipv4_header.length = 20 + icmp_packet.size();
+  ipv4_header.checksum = 0;
+
+  std::vector<uint8_t> ipv4_packet;
+  net::ethernet::ipv4::build(ipv4_header, icmp_packet, ipv4_packet);
+  if (kind == Kind::BadChecksum) {
+    ipv4_packet[10] ^= 0xff;
+  }
+
+  auto ethernet_header = net::ethernet::Header();
+  ethernet_header.type = net::ethernet::PacketType::IPv4;
+  ethernet_header.src_mac = source_mac;
+  ethernet_header.dst_mac = _config.target_mac;
+  net::ethernet::build(ethernet_header, ipv4_packet, result.frame);
+
+  if (kind == Kind::Truncated) {
+    // Cut the frame somewhere inside the IPv4 header.
+    std::uniform_int_distribution<std::size_t> length(
+        sizeof(net::ethernet::Header),
+        sizeof(net::ethernet::Header) + sizeof(net::ethernet::ipv4::Header) -
+            1);
+    result.frame.resize(length(_rng));
+  }
+  return result;
+}
+
+void TrafficGenerator::stamp(std::vector<uint8_t> &frame, Kind kind,
+                             uint32_t sequence) {
+  for (std::size_t offset : {std::size_t{8}, std::size_t{24}}) {
+    frame[offset] = (sequence >> 24) & 0xff;
+    frame[offset + 1] = (sequence >> 16) & 0xff;
+    frame[offset + 2] = (sequence >> 8) & 0xff;
+    frame[offset + 3] = sequence & 0xff;
+    // Only ARP carries the sender MAC a second time, in its payload.
+    if (kind != Kind::ARP)
+      break;
+  }
+}
+
+TrafficReport TrafficGenerator::run(Link &link) {
+  auto count = _config.count;
+  std::vector<std::atomic<int64_t>> sent_at(count);
+  std::vector<std::atomic<bool>> matched(count);
+  std::vector<int64_t> latencies;
+  latencies.reserve(count);
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> received{0};
+  uint64_t unmatched = 0;
+
+  std::thread receiver([&] {
+    std::vector<uint8_t> frame;
+    while (!stop.load(std::memory_order_relaxed)) {
+      if (!link.wait(std::chrono::milliseconds(10)) || link.read(frame) == 0) {
+        continue;
+      }
+
+      auto arrived_at = now_ns();
+      if (frame.size() < sizeof(net::ethernet::Header) || frame[0] != 0x02 ||
+          frame[1] != 0x70) {
+        unmatched++;
+        continue;
+      }
+
+      uint32_t sequence =
+          (frame[2] << 24) | (frame[3] << 16) | (frame[4] << 8) | frame[5];
+      if (sequence >= count ||
+          matched[sequence].exchange(true, std::memory_order_relaxed)) {
+        unmatched++;
+        continue;
+      }
+
+      latencies.push_back(arrived_at -
+                          sent_at[sequence].load(std::memory_order_acquire));
+      received.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  TrafficReport report;
+  std::vector<uint8_t> frame;
+  auto interval = _config.rate ? 1'000'000'000 / _config.rate : 0;
+  auto start = now_ns();
+
+  LOG_INFO("Generating {} frames on {} at {}", count, link.get_name(),
+           _config.rate ? std::format("{} pps", _config.rate) : "line rate");
+  for (uint64_t i = 0; i < count; i++) {
+    if (interval) {
+      auto deadline = start + static_cast<int64_t>(i * interval);
+      auto remaining = deadline - now_ns();
+      if (remaining > 100'000) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+      }
+      while (now_ns() < deadline) {
+      }
+    }
+
+    auto &entry = _templates[i % _templates.size()];
+    frame = entry.frame;
+    stamp(frame, entry.kind, static_cast<uint32_t>(i));
+
+    auto answered = entry.kind == Kind::ARP || entry.kind == Kind::Echo;
+    if (answered) {
+      report.offered++;
+    }
+
+    sent_at[i].store(now_ns(), std::memory_order_release);
+    if (link.write(frame) == 0) {
+      report.dropped++;
+      continue;
+    }
+
+    report.sent++;
+    if (answered) {
+      report.expected++;
+    }
+  }
+  auto tx_done = now_ns();
+
+  auto drain_until =
+      tx_done +
+      std::chrono::duration_cast<std::chrono::nanoseconds>(_config.drain)
+          .count();
+  while (received.load(std::memory_order_relaxed) < report.expected &&
+         now_ns() < drain_until) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  stop = true;
+  receiver.join();
+  auto end = now_ns();
+
+  std::sort(latencies.begin(), latencies.end());
+  report.received = received;
+  report.unmatched = unmatched;
+  report.seconds = (end - start) / 1e9;
+  report.tx_pps = report.sent / ((tx_done - start) / 1e9);
+  report.rx_pps = report.received / report.seconds;
+  report.loss = report.offered ? 1.0 - static_cast<double>(report.received) /
+                                           report.offered
+                               : 0.0;
+  report.stack_loss = report.expected
+                          ? 1.0 - static_cast<double>(report.received) /
+                                      report.expected
+                          : 0.0;
+  report.p50 = percentile(latencies, 0.50);
+  report.p90 = percentile(latencies, 0.90);
+  report.p99 = percentile(latencies, 0.99);
+  report.p999 = percentile(latencies, 0.999);
+  report.max = percentile(latencies, 1.0);
+  return report;
+}
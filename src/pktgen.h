@@ -0,0 +1,84 @@
+#pragma once
+#include "link.h"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+// Relative weights of each kind of frame in the generated traffic.
+struct TrafficMix {
+  unsigned arp{1};
+  unsigned echo{8};
+  unsigned bad_checksum{1};
+  unsigned truncated{0};
+};
+
+struct TrafficConfig {
+  uint64_t count{100000};
+  // Frames per second, 0 sends at line rate.
+  uint64_t rate{0};
+  TrafficMix mix;
+  std::size_t min_payload{56};
+  std::size_t max_payload{56};
+  uint32_t source_ip{0x0A0A0A02};
+  uint32_t target_ip{0x0A0A0A05};
+  std::array<uint8_t, 6> target_mac{0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+  // How long to wait for outstanding replies once everything is sent.
+  std::chrono::milliseconds drain{500};
+};
+
+struct TrafficReport {
+  uint64_t sent{0};
+  // Frames the link did not accept.
+  uint64_t dropped{0};
+  // Frames expecting a reply, whether the link accepted them or not.
+  uint64_t offered{0};
+  // Frames expecting a reply that the link accepted.
+  uint64_t expected{0};
+  uint64_t received{0};
+  uint64_t unmatched{0};
+  double seconds{0};
+  double tx_pps{0};
+  double rx_pps{0};
+  // Unanswered share of the offered frames, including link drops.
+  double loss{0};
+  // Unanswered share of the frames the link accepted.
+  double stack_loss{0};
+  std::chrono::nanoseconds p50{0};
+  std::chrono::nanoseconds p90{0};
+  std::chrono::nanoseconds p99{0};
+  std::chrono::nanoseconds p999{0};
+  std::chrono::nanoseconds max{0};
+
+  std::string to_string() const;
+};
+
+// Synthesizes ARP requests, ICMP echo requests and malformed frames, writes
+// them to a link and matches the replies read back from it. Every frame is
+// sent from a unique source MAC (02:70:<sequence>), which the stack echoes
+// back as the destination of its reply.
+class TrafficGenerator {
+public:
+  explicit TrafficGenerator(TrafficConfig config);
+
+  TrafficReport run(Link &link);
+
+private:
+  enum class Kind { ARP, Echo, BadChecksum, Truncated };
+
+  struct Template {
+    Kind kind;
+    std::vector<uint8_t> frame;
+  };
+
+  Kind pick_kind();
+  Template build_template(Kind kind);
+  static void stamp(std::vector<uint8_t> &frame, Kind kind, uint32_t sequence);
+
+  TrafficConfig _config;
+  std::mt19937 _rng;
+  std::vector<Template> _templates;
+};
@@ -0,0 +1,153 @@
+#include "poller.h"
+#include "log.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdexcept>
+
+std::string PollStats::to_string() const {
+  auto total = spinning + working + waiting;
+  auto percent = [total](std::chrono::nanoseconds part) {
+    return total.count() ? 100.0 * part.count() / total.count() : 0.0;
+  };
+
+  return std::format("PollStats(frames={}, bursts={}, sent={}, "
+                     "empty_polls={}, wakeups={}, spinning={}ms ({:.1f}%), "
+                     "working={}ms ({:.1f}%), waiting={}ms ({:.1f}%))",
+                     frames, bursts, sent, empty_polls, wakeups,
+                     spinning.count() / 1000000, percent(spinning),
+                     working.count() / 1000000, percent(working),
+                     waiting.count() / 1000000, percent(waiting));
+}
+
+Poller::Poller(PollConfig config) : _config(std::move(config)) {}
+
+const PollStats &Poller::stats() const { return _stats; }
+
+void Poller::run(Stack &stack, const std::atomic<bool> &running,
+                 ShmServer *server) {
+  using clock = std::chrono::steady_clock;
+
+  if (!_config.cpus.empty()) {
+    pin_current_thread(_config.cpus);
+  }
+
+  const auto &interfaces = stack.interfaces();
+  auto epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    throw std::runtime_error("epoll_create1 failed: " +
+                             std::string(::strerror(errno)));
+  }
+  for (std::size_t i = 0; i < interfaces.size(); i++) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, interfaces[i].link->get_fd(),
+                    &event) < 0) {
+      ::close(epoll_fd);
+      throw std::runtime_error("epoll_ctl failed: " +
+                               std::string(::strerror(errno)));
+    }
+  }
+  // Tagged past the last interface.
+  if (server) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = interfaces.size();
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server->get_fd(), &event);
+  }
+
+  auto burst = std::clamp<std::size_t>(_config.burst, 1,
+                                       net::ethernet::classify::MAX_BURST);
+  std::vector<std::vector<uint8_t>> buffers(burst);
+  std::vector<struct epoll_event> events(interfaces.size() + 1);
+
+  auto busy = _config.mode == PollConfig::Mode::Busy;
+  auto now = clock::now();
+  auto last_frame = now;
+  // While spinning the epoll set isn't waited on, so applications attaching
+  // or leaving are picked up this often instead.
+  constexpr auto control_interval = std::chrono::milliseconds(10);
+  auto last_control = now;
+
+  LOG_INFO("Polling {} interface(s) ({}, spin budget {}us)", interfaces.size(),
+           busy ? "busy" : "blocking", _config.spin.count());
+  while (running.load(std::memory_order_relaxed)) {
+    if (!busy || now - last_frame > _config.spin) {
+      auto ready = ::epoll_wait(epoll_fd, events.data(),
+                                static_cast<int>(events.size()), 100);
+      auto woke = clock::now();
+      _stats.waiting += woke - now;
+      now = woke;
+      if (ready <= 0) {
+        continue;
+      }
+      _stats.wakeups++;
+      last_frame = now;
+
+      for (int i = 0; i < ready; i++) {
+        if (server && events[i].data.u64 == interfaces.size()) {
+          server->on_ready();
+          last_control = now;
+        }
+      }
+    } else if (server && now - last_control > control_interval) {
+      server->on_ready();
+      last_control = now;
+    }
+
+    auto polled_at = now;
+    std::size_t received = 0;
+    for (std::size_t i = 0; i < interfaces.size(); i++) {
+      std::size_t count = 0;
+      while (count < burst) {
+        auto n = interfaces[i].link->try_read(buffers[count]);
+        if (n == 0)
+          break;
+        count++;
+      }
+
+      if (count) {
+        LOG_TRACE("Read {} frame(s) from {}", count,
+                  interfaces[i].link->get_name());
+        stack.handle_burst(i, {buffers.data(), count});
+        received += count;
+        _stats.bursts++;
+      }
+    }
+    std::size_t sent = server ? server->poll() : 0;
+
+    now = clock::now();
+    if (received == 0 && sent == 0) {
+      // Only busy mode polls on purpose; a blocking wakeup with nothing to
+      // read is still time spent waiting.
+      _stats.empty_polls++;
+      (busy ? _stats.spinning : _stats.waiting) += now - polled_at;
+      continue;
+    }
+
+    _stats.frames += received;
+    _stats.sent += sent;
+    _stats.working += now - polled_at;
+    last_frame = now;
+  }
+
+  ::close(epoll_fd);
+}
+
+void pin_current_thread(const std::vector<int> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+
+  if (::sched_setaffinity(0, sizeof(set), &set) < 0) {
+    throw std::runtime_error("sched_setaffinity failed: " +
+                             std::string(::strerror(errno)));
+  }
+  LOG_DEBUG("Pinned thread to {} CPU(s)", cpus.size());
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "link.h"
+#include "shm.h"
+#include "stack.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct PollConfig {
+  enum class Mode { Blocking, Busy };
+
+  Mode mode{Mode::Blocking};
+  // In busy mode, how long to keep spinning on an idle link before falling
+  // back to a blocking wait.
+  std::chrono::microseconds spin{50};
+  // Maximum number of frames read before they are handed to the stack.
+  std::size_t burst{32};
+  // CPUs the polling thread is pinned to, empty leaves affinity untouched.
+  std::vector<int> cpus;
+};
+
+struct PollStats {
+  uint64_t frames{0};
+  uint64_t bursts{0};
+  // Payloads sent on behalf of shared-memory applications.
+  uint64_t sent{0};
+  uint64_t empty_polls{0};
+  uint64_t wakeups{0};
+  std::chrono::nanoseconds spinning{0};
+  std::chrono::nanoseconds working{0};
+  std::chrono::nanoseconds waiting{0};
+
+  std::string to_string() const;
+};
+
+// Reads bursts of frames from the stack's links and hands them to it. In busy
+// mode the links are polled without blocking for up to the spin budget after
+// the last frame, trading CPU time for latency, before sleeping in epoll_wait.
+class Poller {
+public:
+  explicit Poller(PollConfig config);
+
+  // Polls every interface of the stack, and the transmit rings of the
+  // server's applications if given, until `running` is cleared.
+  void run(Stack &stack, const std::atomic<bool> &running,
+           ShmServer *server = nullptr);
+
+  const PollStats &stats() const;
+
+private:
+  PollConfig _config;
+  PollStats _stats;
+};
+
+// Restricts the calling thread to the given CPUs.
+void pin_current_thread(const std::vector<int> &cpus);
@@ -0,0 +1,382 @@
+#include "recorder.h"
+#include "log.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+namespace recorder {
+namespace {
+static_assert((RING_SIZE & (RING_SIZE - 1)) == 0,
+              "ring size must be a power of 2");
+
+constexpr std::size_t MAX_RINGS = 64;
+constexpr char MAGIC[8] = {'T', 'C', 'P', 'I', 'P', 'F', 'R', '1'};
+constexpr uint32_t VERSION = 2;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t ring_size;
+  uint32_t ring_count;
+};
+
+struct RingHeader {
+  uint32_t thread_id;
+  uint32_t reserved;
+  uint64_t head;
+};
+
+// Written only by its owning thread. Rings are never freed so that events of
+// threads that have exited still make it into a dump.
+struct Ring {
+  std::atomic<uint64_t> head{0};
+  uint32_t thread_id{0};
+  Event events[RING_SIZE];
+};
+
+std::array<std::atomic<Ring *>, MAX_RINGS> rings{};
+std::atomic<std::size_t> ring_count{0};
+thread_local Ring *local_ring = nullptr;
+
+char dump_path[PATH_MAX];
+
+Ring *register_ring() {
+  auto *ring = new Ring();
+  ring->thread_id = static_cast<uint32_t>(::gettid());
+
+  auto index = ring_count.fetch_add(1);
+  if (index < MAX_RINGS) {
+    rings[index].store(ring, std::memory_order_release);
+  } else {
+    LOG_WARN("Flight recorder full, thread {} will not be dumped",
+             ring->thread_id);
+  }
+  return ring;
+}
+
+bool write_all(int fd, const void *data, std::size_t size) {
+  const auto *p = static_cast<const uint8_t *>(data);
+  while (size) {
+    auto n = ::write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+void on_dump_signal(int) {
+  auto saved_errno = errno;
+  dump(dump_path);
+  errno = saved_errno;
+}
+
+void on_fatal_signal(int signal) {
+  dump(dump_path);
+  // The handler was reset by SA_RESETHAND, so this terminates as usual.
+  ::raise(signal);
+}
+
+void put(std::vector<uint8_t> &out, const void *data, std::size_t size) {
+  const auto *p = static_cast<const uint8_t *>(data);
+  out.insert(out.end(), p, p + size);
+}
+void put16(std::vector<uint8_t> &out, uint16_t value) {
+  put(out, &value, sizeof(value));
+}
+void put32(std::vector<uint8_t> &out, uint32_t value) {
+  put(out, &value, sizeof(value));
+}
+void pad32(std::vector<uint8_t> &out) { out.resize((out.size() + 3) & ~3); }
+
+// Writes a pcapng block; `body` is everything between the length fields.
+void write_block(std::ofstream &out, uint32_t type,
+                 const std::vector<uint8_t> &body) {
+  uint32_t length = static_cast<uint32_t>(body.size() + 12);
+  out.write(reinterpret_cast<const char *>(&type), 4);
+  out.write(reinterpret_cast<const char *>(&length), 4);
+  out.write(reinterpret_cast<const char *>(body.data()), body.size());
+  out.write(reinterpret_cast<const char *>(&length), 4);
+}
+} // namespace
+
+std::string type_to_string(EventType type) {
+  switch (type) {
+  case EventType::RX:
+    return "rx";
+  case EventType::TX:
+    return "tx";
+  case EventType::Drop:
+    return "drop";
+  case EventType::Decision:
+    return "decision";
+  default:
+    return "unknown";
+  }
+}
+
+std::string reason_to_string(Reason reason) {
+  switch (reason) {
+  case Reason::None:
+    return "none";
+  case Reason::Truncated:
+    return "truncated";
+  case Reason::UnsupportedType:
+    return "unsupported-type";
+  case Reason::BadARP:
+    return "bad-arp";
+  case Reason::BadIPv4:
+    return "bad-ipv4";
+  case Reason::BadICMP:
+    return "bad-icmp";
+  case Reason::UnsupportedProtocol:
+    return "unsupported-protocol";
+  case Reason::NotForUs:
+    return "not-for-us";
+  case Reason::LinkFull:
+    return "link-full";
+  case Reason::ARPReply:
+    return "arp-reply";
+  case Reason::EchoReply:
+    return "echo-reply";
+  case Reason::NoRoute:
+    return "no-route";
+  case Reason::NoNeighbor:
+    return "no-neighbor";
+  case Reason::TTLExceeded:
+    return "ttl-exceeded";
+  case Reason::Forwarded:
+    return "forwarded";
+  case Reason::Delivered:
+    return "delivered";
+  default:
+    return "unknown";
+  }
+}
+
+void record(EventType type, Reason reason, std::span<const uint8_t> frame) {
+  auto *ring = local_ring;
+  if (!ring) [[unlikely]] {
+    ring = local_ring = register_ring();
+  }
+
+  auto head = ring->head.load(std::memory_order_relaxed);
+  auto &event = ring->events[head & (RING_SIZE - 1)];
+
+  struct timespec now;
+  ::clock_gettime(CLOCK_REALTIME, &now);
+  event.timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+  event.length =
+      static_cast<uint16_t>(std::min<std::size_t>(frame.size(), 0xffff));
+  event.type = type;
+  event.reason = reason;
+  event.captured = static_cast<uint8_t>(std::min(frame.size(), CAPTURE_SIZE));
+  std::memcpy(event.data, frame.data(), event.captured);
+
+  const uint8_t *f = frame.data();
+  event.ethertype = frame.size() >= 14 ? (f[12] << 8) | f[13] : 0;
+  event.protocol = 0;
+  event.source = 0;
+  event.destination = 0;
+  event.source_port = 0;
+  event.destination_port = 0;
+  if (event.ethertype == 0x0800 && frame.size() >= 34) {
+    event.protocol = f[23];
+    event.source = (f[26] << 24) | (f[27] << 16) | (f[28] << 8) | f[29];
+    event.destination = (f[30] << 24) | (f[31] << 16) | (f[32] << 8) | f[33];
+
+    // TCP and UDP both start with the source and destination ports.
+    std::size_t l4 = 14 + (f[14] & 0x0f) * 4;
+    if ((event.protocol == 0x06 || event.protocol == 0x11) &&
+        frame.size() >= l4 + 4) {
+      event.source_port = (f[l4] << 8) | f[l4 + 1];
+      event.destination_port = (f[l4 + 2] << 8) | f[l4 + 3];
+    }
+  }
+
+  std::atomic_ref<uint32_t>(event.sequence)
+      .store(static_cast<uint32_t>(head), std::memory_order_release);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool dump(const char *path) {
+  auto fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  auto count = std::min(ring_count.load(std::memory_order_acquire), MAX_RINGS);
+  uint32_t registered = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    registered += rings[i].load(std::memory_order_acquire) != nullptr;
+  }
+
+  FileHeader header{};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.event_size = sizeof(Event);
+  header.ring_size = RING_SIZE;
+  header.ring_count = registered;
+  auto ok = write_all(fd, &header, sizeof(header));
+
+  for (std::size_t i = 0; i < count && ok; i++) {
+    auto *ring = rings[i].load(std::memory_order_acquire);
+    if (!ring)
+      continue;
+
+    // The owner keeps recording while we copy. The header is rewritten with
+    // the head as of the end of the copy, so the converter can tell which
+    // slots may have been overwritten, or half-written, in the meantime.
+    RingHeader ring_header{};
+    ring_header.thread_id = ring->thread_id;
+    ring_header.head = ring->head.load(std::memory_order_acquire);
+    auto offset = ::lseek(fd, 0, SEEK_CUR);
+    ok = write_all(fd, &ring_header, sizeof(ring_header)) &&
+         write_all(fd, ring->events, sizeof(ring->events));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    ring_header.head = ring->head.load(std::memory_order_acquire);
+    ok = ok && ::pwrite(fd, &ring_header, sizeof(ring_header), offset) ==
+                   static_cast<ssize_t>(sizeof(ring_header));
+  }
+
+  ::close(fd);
+  return ok;
+}
+
+void install(const std::string &path) {
+  if (path.size() >= sizeof(dump_path)) {
+    throw std::invalid_argument("flight recorder path too long");
+  }
+  std::memcpy(dump_path, path.c_str(), path.size() + 1);
+
+  struct sigaction action {};
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = on_dump_signal;
+  action.sa_flags = SA_RESTART;
+  ::sigaction(SIGUSR1, &action, nullptr);
+
+  action.sa_handler = on_fatal_signal;
+  action.sa_flags = SA_RESETHAND | SA_NODEFER;
+  for (auto signal : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+    ::sigaction(signal, &action, nullptr);
+  }
+
+  LOG_DEBUG("Flight recorder dumps to {} (SIGUSR1 or crash)", path);
+}
+
+void convert(const std::string &input, const std::string &output) {
+  std::ifstream in(input, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Failed to open " + input);
+  }
+
+  FileHeader header{};
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION || header.event_size != sizeof(Event) ||
+      header.ring_size != RING_SIZE) {
+    throw std::runtime_error(input + " is not a flight recorder dump");
+  }
+
+  struct Entry {
+    uint32_t thread_id;
+    Event event;
+  };
+  std::vector<Entry> entries;
+  std::vector<Event> events(RING_SIZE);
+  for (uint32_t i = 0; i < header.ring_count; i++) {
+    RingHeader ring_header{};
+    in.read(reinterpret_cast<char *>(&ring_header), sizeof(ring_header));
+    in.read(reinterpret_cast<char *>(events.data()),
+            events.size() * sizeof(Event));
+    if (!in) {
+      throw std::runtime_error(input + " is truncated");
+    }
+
+    // The slot of event `head - RING_SIZE` may have been in the middle of
+    // being reused when the dump ended, and slots whose sequence doesn't
+    // match were overwritten by newer events during it.
+    auto head = ring_header.head;
+    auto first = head >= RING_SIZE ? head - RING_SIZE + 1 : 0;
+    for (auto seq = first; seq < head; seq++) {
+      const auto &event = events[seq % RING_SIZE];
+      if (event.sequence == static_cast<uint32_t>(seq)) {
+        entries.push_back({ring_header.thread_id, event});
+      }
+    }
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry &a, const Entry &b) {
+                     return a.event.timestamp < b.event.timestamp;
+                   });
+
+  std::ofstream out(output, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Failed to open " + output);
+  }
+
+  std::vector<uint8_t> body;
+  // Section header: byte-order magic, version 1.0, unknown section length.
+  put32(body, 0x1A2B3C4D);
+  put16(body, 1);
+  put16(body, 0);
+  put32(body, 0xffffffff);
+  put32(body, 0xffffffff);
+  write_block(out, 0x0A0D0D0A, body);
+
+  // Interface description: ethernet, nanosecond timestamps (if_tsresol = 9).
+  body.clear();
+  put16(body, 1);
+  put16(body, 0);
+  put32(body, CAPTURE_SIZE);
+  put16(body, 9);
+  put16(body, 1);
+  body.push_back(9);
+  pad32(body);
+  put32(body, 0);
+  write_block(out, 0x00000001, body);
+
+  for (const auto &[thread_id, event] : entries) {
+    auto captured = std::min<std::size_t>(event.captured, CAPTURE_SIZE);
+    auto comment =
+        event.reason == Reason::None
+            ? std::format("{} thread={}", type_to_string(event.type),
+                          thread_id)
+            : std::format("{} {} thread={}", type_to_string(event.type),
+                          reason_to_string(event.reason), thread_id);
+
+    // Enhanced packet block with the annotation as opt_comment.
+    body.clear();
+    put32(body, 0);
+    put32(body, static_cast<uint32_t>(event.timestamp >> 32));
+    put32(body, static_cast<uint32_t>(event.timestamp));
+    put32(body, static_cast<uint32_t>(captured));
+    put32(body, event.length);
+    put(body, event.data, captured);
+    pad32(body);
+    put16(body, 1);
+    put16(body, static_cast<uint16_t>(comment.size()));
+    put(body, comment.data(), comment.size());
+    pad32(body);
+    put32(body, 0);
+    write_block(out, 0x00000006, body);
+  }
+
+  LOG_INFO("Converted {} events from {} to {}", entries.size(), input, output);
+}
+} // namespace recorder
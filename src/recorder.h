@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+// Always-on flight recorder. Every thread records compact binary events into
+// its own fixed-size ring, overwriting the oldest ones. Rings can be dumped on
+// SIGUSR1 or on a crash, and the dump converted to pcapng offline.
+namespace recorder {
+enum class EventType : uint8_t { RX, TX, Drop, Decision };
+
+enum class Reason : uint8_t {
+  None,
+  // Drops
+  Truncated,
+  UnsupportedType,
+  BadARP,
+  BadIPv4,
+  BadICMP,
+  UnsupportedProtocol,
+  NotForUs,
+  LinkFull,
+  // Decisions
+  ARPReply,
+  EchoReply,
+  // Forwarding drops and decisions
+  NoRoute,
+  NoNeighbor,
+  TTLExceeded,
+  Forwarded,
+  // Handed to an application over shared memory
+  Delivered,
+};
+
+std::string type_to_string(EventType type);
+std::string reason_to_string(Reason reason);
+
+inline constexpr std::size_t CAPTURE_SIZE = 96;
+inline constexpr std::size_t RING_SIZE = 4096;
+
+struct Event {
+  uint64_t timestamp; // ns since the epoch
+  uint16_t length;    // of the whole frame
+  uint16_t ethertype;
+  EventType type;
+  Reason reason;
+  uint8_t protocol;
+  uint8_t captured; // bytes of the frame kept in `data`
+  uint32_t source;
+  uint32_t destination;
+  uint16_t source_port;
+  uint16_t destination_port;
+  // Low 32 bits of the event's position in its ring, written last.
+  uint32_t sequence;
+  uint8_t data[CAPTURE_SIZE];
+};
+static_assert(sizeof(Event) == 128);
+
+void record(EventType type, Reason reason, std::span<const uint8_t> frame);
+
+inline void rx(std::span<const uint8_t> frame) {
+  record(EventType::RX, Reason::None, frame);
+}
+inline void tx(std::span<const uint8_t> frame) {
+  record(EventType::TX, Reason::None, frame);
+}
+inline void drop(Reason reason, std::span<const uint8_t> frame) {
+  record(EventType::Drop, reason, frame);
+}
+inline void decision(Reason reason, std::span<const uint8_t> frame) {
+  record(EventType::Decision, reason, frame);
+}
+
+// Dumps all rings to `path`. Async-signal-safe.
+bool dump(const char *path);
+
+// Dumps to `path` on SIGUSR1 and before dying on a fatal signal.
+void install(const std::string &path);
+
+// Converts a dump into a pcapng file, one packet per event, annotated with
+// the event type, reason and recording thread.
+void convert(const std::string &input, const std::string &output);
+} // namespace recorder
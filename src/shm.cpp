@@ -0,0 +1,474 @@
+#include "shm.h"
+#include "log.h"
+#include "net/ipv4.h"
+#include "stack.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+constexpr uint32_t VERSION = 1;
+constexpr uint64_t LISTEN_TAG = ~uint64_t{0};
+constexpr uint64_t DOORBELL_TAG = ~uint64_t{1};
+
+std::runtime_error system_error(const std::string &what) {
+  return std::runtime_error(what +
+                            " failed: " + std::string(::strerror(errno)));
+}
+
+void signal_event(int fd) {
+  uint64_t one = 1;
+  [[maybe_unused]] auto n = ::write(fd, &one, sizeof(one));
+}
+
+void clear_event(int fd) {
+  uint64_t count;
+  [[maybe_unused]] auto n = ::read(fd, &count, sizeof(count));
+}
+
+sockaddr_un socket_address(const std::string &path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("socket path too long: " + path);
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+// The port a payload is matched on: the TCP/UDP destination port or the ICMP
+// identifier.
+uint16_t port_of(uint8_t protocol, std::span<const uint8_t> payload) {
+  if ((protocol == 0x06 || protocol == 0x11) && payload.size() >= 4) {
+    return (payload[2] << 8) | payload[3];
+  }
+  if (protocol == 0x01 && payload.size() >= 6) {
+    return (payload[4] << 8) | payload[5];
+  }
+  return 0;
+}
+} // namespace
+
+namespace shm {
+Region *map(int fd) {
+  auto *memory = ::mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    throw system_error("mmap");
+  }
+  return static_cast<Region *>(memory);
+}
+
+void unmap(Region *region) { ::munmap(region, sizeof(Region)); }
+} // namespace shm
+
+ShmServer::Channel::~Channel() {
+  if (region)
+    shm::unmap(region);
+  for (auto fd : {socket, memory_fd, rx_event}) {
+    if (fd >= 0)
+      ::close(fd);
+  }
+}
+
+ShmServer::ShmServer(Stack &stack, std::string socket_path)
+    : _stack(stack), _socket_path(std::move(socket_path)) {
+  auto address = socket_address(_socket_path);
+  ::unlink(_socket_path.c_str());
+
+  _listen_fd =
+      ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_listen_fd < 0) {
+    throw system_error("socket");
+  }
+  if (::bind(_listen_fd, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(_listen_fd, 16) < 0) {
+    ::close(_listen_fd);
+    throw system_error("bind " + _socket_path);
+  }
+
+  _epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+  _doorbell = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_epoll_fd < 0 || _doorbell < 0) {
+    throw system_error("epoll/eventfd");
+  }
+
+  for (auto [fd, tag] : {std::pair{_listen_fd, LISTEN_TAG},
+                         std::pair{_doorbell, DOORBELL_TAG}}) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    ::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  LOG_INFO("Shared memory channels on {}", _socket_path);
+}
+
+ShmServer::~ShmServer() {
+  _channels.clear();
+  for (auto fd : {_listen_fd, _epoll_fd, _doorbell}) {
+    if (fd >= 0)
+      ::close(fd);
+  }
+  ::unlink(_socket_path.c_str());
+}
+
+int ShmServer::get_fd() const { return _epoll_fd; }
+
+void ShmServer::on_ready() {
+  struct epoll_event events[16];
+  auto n = ::epoll_wait(_epoll_fd, events, std::size(events), 0);
+  for (int i = 0; i < n; i++) {
+    auto tag = events[i].data.u64;
+    if (tag == LISTEN_TAG) {
+      accept_application();
+    } else if (tag == DOORBELL_TAG) {
+      // Cleared before poll() drains the rings, so nothing queued after this
+      // point can be missed.
+      clear_event(_doorbell);
+    } else {
+      auto *channel = reinterpret_cast<Channel *>(events[i].data.ptr);
+      if (!channel->region) {
+        register_application(*channel);
+      } else {
+        // Applications send nothing after registering; readable means gone.
+        close_channel(channel);
+      }
+    }
+  }
+}
+
+void ShmServer::accept_application() {
+  int fd;
+  while ((fd = ::accept4(_listen_fd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    auto channel = std::make_unique<Channel>();
+    channel->socket = fd;
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = channel.get();
+    ::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    _channels.push_back(std::move(channel));
+  }
+}
+
+void ShmServer::register_application(Channel &channel) {
+  shm::Registration registration{};
+  auto n = ::recv(channel.socket, &registration, sizeof(registration), 0);
+  if (n != sizeof(registration)) {
+    LOG_WARN("Invalid shared memory registration");
+    close_channel(&channel);
+    return;
+  }
+
+  try {
+    channel.memory_fd = ::memfd_create("tcp_ip-shm", MFD_CLOEXEC);
+    if (channel.memory_fd < 0 ||
+        ::ftruncate(channel.memory_fd, sizeof(shm::Region)) < 0) {
+      throw system_error("memfd_create");
+    }
+    channel.rx_event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel.rx_event < 0) {
+      throw system_error("eventfd");
+    }
+
+    channel.region = new (shm::map(channel.memory_fd)) shm::Region();
+    channel.region->magic = shm::MAGIC;
+    channel.region->version = VERSION;
+  } catch (const std::exception &e) {
+    LOG_ERROR("{}", e.what());
+    close_channel(&channel);
+    return;
+  }
+
+  channel.registration = registration;
+  channel.in_flight.assign(shm::RING_SIZE, false);
+  channel.free_slots.reserve(shm::RING_SIZE);
+  for (uint32_t slot = shm::RING_SIZE; slot-- > 0;) {
+    channel.free_slots.push_back(slot);
+  }
+
+  // Pass the region and both eventfds along with the acknowledgement.
+  int fds[3] = {channel.memory_fd, channel.rx_event, _doorbell};
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  uint32_t status = 0;
+  struct iovec iov = {&status, sizeof(status)};
+  struct msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  auto *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (::sendmsg(channel.socket, &message, MSG_NOSIGNAL) < 0) {
+    LOG_WARN("Failed to answer shared memory registration: {}",
+             ::strerror(errno));
+    close_channel(&channel);
+    return;
+  }
+
+  LOG_INFO("Application registered for {} protocol {} port {}",
+           net::ethernet::ipv4::ip_to_string(registration.ip),
+           registration.protocol, registration.port);
+}
+
+void ShmServer::close_channel(Channel *channel) {
+  ::epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, channel->socket, nullptr);
+  std::erase_if(_channels,
+                [channel](const auto &c) { return c.get() == channel; });
+  LOG_INFO("Application disconnected");
+}
+
+std::size_t ShmServer::poll() {
+  std::size_t sent = 0;
+  Channel *broken = nullptr;
+  for (auto &channel : _channels) {
+    if (!channel->region)
+      continue;
+
+    auto &region = *channel->region;
+    if (channel->broken || !region.tx.valid() || !region.tx_free.valid()) {
+      broken = channel.get();
+      continue;
+    }
+
+    // The application is not trusted with slot numbers, lengths or
+    // protocols.
+    const auto &registered = channel->registration.protocol;
+    shm::Descriptor descriptor;
+    for (uint32_t i = 0; i < shm::RING_SIZE && region.tx.pop(descriptor);
+         i++) {
+      if (descriptor.slot < shm::RING_SIZE ||
+          descriptor.slot >= shm::SLOT_COUNT) {
+        continue;
+      }
+
+      auto protocol = descriptor.protocol ? descriptor.protocol : registered;
+      if (descriptor.length <= shm::SLOT_SIZE && protocol &&
+          (!registered || protocol == registered)) {
+        _stack.send_ipv4(descriptor.peer, protocol,
+                         {region.slots[descriptor.slot], descriptor.length});
+        sent++;
+      }
+
+      bool was_empty;
+      region.tx_free.push(descriptor.slot, was_empty);
+    }
+  }
+
+  // At most one per call, as closing invalidates the iteration above.
+  if (broken) {
+    LOG_WARN("Closing shared memory channel with corrupt rings");
+    close_channel(broken);
+  }
+  return sent;
+}
+
+bool ShmServer::deliver(std::span<const uint8_t> packet) {
+  if (_channels.empty() || packet.size() < 20) {
+    return false;
+  }
+
+  // The total length excludes any ethernet padding.
+  std::size_t header_length = (packet[0] & 0x0f) * 4;
+  std::size_t total_length = (packet[2] << 8) | packet[3];
+  if (total_length < header_length || packet.size() < total_length) {
+    return false;
+  }
+  auto payload = packet.subspan(header_length, total_length - header_length);
+  uint8_t protocol = packet[9];
+  uint16_t port = port_of(protocol, payload);
+  uint32_t source =
+      (packet[12] << 24) | (packet[13] << 16) | (packet[14] << 8) | packet[15];
+  uint32_t destination =
+      (packet[16] << 24) | (packet[17] << 16) | (packet[18] << 8) | packet[19];
+
+  for (auto &channel : _channels) {
+    const auto &wanted = channel->registration;
+    if (!channel->region || (wanted.ip && wanted.ip != destination) ||
+        (wanted.protocol && wanted.protocol != protocol) ||
+        (wanted.port && wanted.port != port)) {
+      continue;
+    }
+
+    auto &region = *channel->region;
+    if (channel->broken || !region.rx.valid() || !region.rx_free.valid()) {
+      // Closed by the next poll().
+      channel->broken = true;
+      return false;
+    }
+
+    // Only slots actually handed out are taken back, each once.
+    uint32_t slot;
+    for (uint32_t i = 0; i < shm::RING_SIZE && region.rx_free.pop(slot);
+         i++) {
+      if (slot < shm::RING_SIZE && channel->in_flight[slot]) {
+        channel->in_flight[slot] = false;
+        channel->free_slots.push_back(slot);
+      }
+    }
+    if (channel->free_slots.empty() || payload.size() > shm::SLOT_SIZE) {
+      return false;
+    }
+
+    slot = channel->free_slots.back();
+    channel->free_slots.pop_back();
+    std::memcpy(region.slots[slot], payload.data(), payload.size());
+
+    shm::Descriptor descriptor{};
+    descriptor.slot = slot;
+    descriptor.length = static_cast<uint32_t>(payload.size());
+    descriptor.peer = source;
+    descriptor.local = destination;
+    descriptor.protocol = protocol;
+    descriptor.port = port;
+
+    bool was_empty;
+    if (!region.rx.push(descriptor, was_empty)) {
+      channel->free_slots.push_back(slot);
+      return false;
+    }
+    channel->in_flight[slot] = true;
+    if (was_empty) {
+      signal_event(channel->rx_event);
+    }
+    return true;
+  }
+  return false;
+}
+
+ShmClient::ShmClient(const std::string &socket_path,
+                     shm::Registration registration)
+    : _registration(registration) {
+  auto address = socket_address(socket_path);
+  _socket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (_socket < 0) {
+    throw system_error("socket");
+  }
+  if (::connect(_socket, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)) < 0) {
+    throw system_error("connect " + socket_path);
+  }
+  if (::send(_socket, &registration, sizeof(registration), 0) < 0) {
+    throw system_error("send");
+  }
+
+  int fds[3];
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  uint32_t status = 1;
+  struct iovec iov = {&status, sizeof(status)};
+  struct msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  if (::recvmsg(_socket, &message, MSG_CMSG_CLOEXEC) < 0) {
+    throw system_error("recvmsg");
+  }
+  auto *cmsg = CMSG_FIRSTHDR(&message);
+  if (status != 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    throw std::runtime_error("Registration rejected by " + socket_path);
+  }
+  std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  _rx_event = fds[1];
+  _doorbell = fds[2];
+
+  _region = shm::map(fds[0]);
+  ::close(fds[0]);
+  if (_region->magic != shm::MAGIC || _region->version != VERSION) {
+    throw std::runtime_error("Unexpected shared memory layout");
+  }
+
+  _free_slots.reserve(shm::RING_SIZE);
+  for (uint32_t slot = shm::SLOT_COUNT; slot-- > shm::RING_SIZE;) {
+    _free_slots.push_back(slot);
+  }
+}
+
+ShmClient::~ShmClient() {
+  if (_region)
+    shm::unmap(_region);
+  for (auto fd : {_socket, _rx_event, _doorbell}) {
+    if (fd >= 0)
+      ::close(fd);
+  }
+}
+
+bool ShmClient::receive(Packet &packet) {
+  shm::Descriptor descriptor;
+  if (!_region->rx.pop(descriptor)) {
+    return false;
+  }
+
+  auto slot = std::min(descriptor.slot, shm::RING_SIZE - 1);
+  auto length = std::min(descriptor.length, shm::SLOT_SIZE);
+  packet.descriptor = descriptor;
+  packet.payload = {_region->slots[slot], length};
+  return true;
+}
+
+void ShmClient::release(const Packet &packet) {
+  bool was_empty;
+  _region->rx_free.push(packet.descriptor.slot, was_empty);
+}
+
+bool ShmClient::wait(std::chrono::milliseconds timeout) {
+  struct pollfd fd = {_rx_event, POLLIN, 0};
+  if (::poll(&fd, 1, static_cast<int>(timeout.count())) <= 0) {
+    return false;
+  }
+  clear_event(_rx_event);
+  return true;
+}
+
+int ShmClient::get_fd() const { return _rx_event; }
+
+std::span<uint8_t> ShmClient::allocate() {
+  uint32_t slot;
+  while (_region->tx_free.pop(slot)) {
+    _free_slots.push_back(slot);
+  }
+  if (_free_slots.empty()) {
+    return {};
+  }
+
+  slot = _free_slots.back();
+  _free_slots.pop_back();
+  return {_region->slots[slot], shm::SLOT_SIZE};
+}
+
+bool ShmClient::send(std::span<uint8_t> buffer, std::size_t length,
+                     uint32_t destination, uint8_t protocol) {
+  shm::Descriptor descriptor{};
+  descriptor.slot =
+      static_cast<uint32_t>((buffer.data() - &_region->slots[0][0]) /
+                            shm::SLOT_SIZE);
+  descriptor.length =
+      static_cast<uint32_t>(std::min<std::size_t>(length, shm::SLOT_SIZE));
+  descriptor.peer = destination;
+  descriptor.protocol = protocol ? protocol : _registration.protocol;
+
+  bool was_empty;
+  if (!_region->tx.push(descriptor, was_empty)) {
+    return false;
+  }
+  if (was_empty) {
+    signal_event(_doorbell);
+  }
+  return true;
+}
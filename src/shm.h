@@ -0,0 +1,202 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+class Stack;
+
+// Shared-memory channel between the stack and external application
+// processes. Each registered application gets its own mapped region holding
+// packet slots and four single-producer/single-consumer descriptor rings:
+//
+//   rx       stack -> app   received payloads
+//   rx_free  app -> stack   rx slots the application is done with
+//   tx       app -> stack   payloads to send
+//   tx_free  stack -> app   tx slots the stack is done with
+//
+// Payloads are the IPv4 payload (transport header onwards). Neither side makes
+// a syscall on the data path; eventfds are only signalled when the consumer of
+// a ring had emptied it and may be waiting.
+namespace shm {
+inline constexpr uint32_t MAGIC = 0x73686d31; // "shm1"
+inline constexpr uint32_t RING_SIZE = 1024;
+inline constexpr uint32_t SLOT_SIZE = 2048;
+// The first RING_SIZE slots are used for rx, the rest for tx.
+inline constexpr uint32_t SLOT_COUNT = 2 * RING_SIZE;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+struct Descriptor {
+  uint32_t slot;
+  uint32_t length;
+  // Remote address (source on rx, destination on tx), host byte order.
+  uint32_t peer;
+  // Local address the payload was sent to, host byte order.
+  uint32_t local;
+  // IP protocol; on tx, 0 means the registered one.
+  uint8_t protocol;
+  uint8_t reserved;
+  // TCP/UDP destination port or ICMP identifier.
+  uint16_t port;
+};
+
+template <typename T> struct Ring {
+  alignas(64) std::atomic<uint32_t> head;
+  alignas(64) std::atomic<uint32_t> tail;
+  alignas(64) T entries[RING_SIZE];
+
+  // Returns false if the ring is full. `was_empty` tells whether the consumer
+  // had caught up, i.e. whether it may be asleep and needs a wakeup. The
+  // sequentially consistent head store/tail load here pairs with the tail
+  // store/head load in pop(), so a push can't go unnoticed by a consumer that
+  // is about to sleep.
+  bool push(const T &value, bool &was_empty) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= RING_SIZE) {
+      return false;
+    }
+
+    entries[h % RING_SIZE] = value;
+    head.store(h + 1, std::memory_order_seq_cst);
+    was_empty = tail.load(std::memory_order_seq_cst) == h;
+    return true;
+  }
+
+  // Returns false if the ring is empty, or if its indices are corrupt.
+  bool pop(T &value) {
+    auto t = tail.load(std::memory_order_relaxed);
+    auto available = head.load(std::memory_order_seq_cst) - t;
+    if (available == 0 || available > RING_SIZE) {
+      return false;
+    }
+
+    value = entries[t % RING_SIZE];
+    tail.store(t + 1, std::memory_order_seq_cst);
+    return true;
+  }
+
+  // The other side of a ring is not trusted to keep its index in range.
+  bool valid() const {
+    return head.load(std::memory_order_acquire) -
+               tail.load(std::memory_order_acquire) <=
+           RING_SIZE;
+  }
+};
+
+struct Region {
+  uint32_t magic;
+  uint32_t version;
+  Ring<Descriptor> rx;
+  Ring<uint32_t> rx_free;
+  Ring<Descriptor> tx;
+  Ring<uint32_t> tx_free;
+  alignas(64) uint8_t slots[SLOT_COUNT][SLOT_SIZE];
+};
+
+// Sent by an application right after connecting to the control socket.
+// Zero fields match anything; `port` is the TCP/UDP destination port or the
+// ICMP identifier.
+struct Registration {
+  uint32_t ip;
+  uint8_t protocol;
+  uint8_t reserved;
+  uint16_t port;
+};
+
+// Maps a region shared through `fd`.
+Region *map(int fd);
+void unmap(Region *region);
+} // namespace shm
+
+// Stack side: accepts registrations on a unix socket, delivers matching
+// received packets and sends what applications queue on their tx rings.
+class ShmServer {
+public:
+  ShmServer(Stack &stack, std::string socket_path);
+  ~ShmServer();
+
+  // Readable when an application connected, disconnected or queued
+  // payloads while the stack may have been asleep.
+  int get_fd() const;
+  // Handles what made get_fd() readable. Makes syscalls, so it is only
+  // meant to be called after a wakeup.
+  void on_ready();
+  // Sends what applications queued, up to a ring's worth per application;
+  // returns the number of payloads. Closes channels whose rings are corrupt.
+  std::size_t poll();
+
+  // Hands an IPv4 packet addressed to us to the application registered for
+  // it; returns false if there is none or its ring is full.
+  bool deliver(std::span<const uint8_t> packet);
+
+private:
+  struct Channel {
+    int socket{-1};
+    int memory_fd{-1};
+    int rx_event{-1};
+    shm::Region *region{nullptr};
+    shm::Registration registration{};
+    std::vector<uint32_t> free_slots;
+    // Rx slots handed to the application and not returned yet.
+    std::vector<bool> in_flight;
+    // Set when the application corrupted its rings.
+    bool broken{false};
+
+    ~Channel();
+  };
+
+  void accept_application();
+  void register_application(Channel &channel);
+  void close_channel(Channel *channel);
+
+  Stack &_stack;
+  std::string _socket_path;
+  int _listen_fd{-1};
+  int _epoll_fd{-1};
+  int _doorbell{-1};
+  std::vector<std::unique_ptr<Channel>> _channels;
+};
+
+// Application side of a channel.
+class ShmClient {
+public:
+  struct Packet {
+    shm::Descriptor descriptor;
+    std::span<const uint8_t> payload;
+  };
+
+  ShmClient(const std::string &socket_path, shm::Registration registration);
+  ~ShmClient();
+
+  // Takes the next received payload without blocking; returns false if there
+  // is none. The payload stays valid until release().
+  bool receive(Packet &packet);
+  void release(const Packet &packet);
+  // Waits up to `timeout` (-1 for ever) for payloads to arrive on an empty
+  // ring; returns false on timeout.
+  bool wait(std::chrono::milliseconds timeout);
+  // Readable when payloads arrive on an empty ring.
+  int get_fd() const;
+
+  // Returns a tx slot to write a payload into, or an empty span if all are
+  // in flight.
+  std::span<uint8_t> allocate();
+  // Queues the first `length` bytes of an allocated slot for `destination`.
+  // `protocol` defaults to the registered one, and is required when the
+  // registration matches any protocol.
+  bool send(std::span<uint8_t> buffer, std::size_t length,
+            uint32_t destination, uint8_t protocol = 0);
+
+private:
+  int _socket{-1};
+  int _rx_event{-1};
+  int _doorbell{-1};
+  shm::Region *_region{nullptr};
+  shm::Registration _registration;
+  std::vector<uint32_t> _free_slots;
+};
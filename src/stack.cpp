@@ -0,0 +1,570 @@
+#include "stack.h"
+#include "log.h"
+#include "net/arp.h"
+#include "net/icmp.h"
+#include "net/ipv4.h"
+#include "recorder.h"
+#include "shm.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Why the classifier dropped a frame, for the flight recorder.
+static recorder::Reason drop_reason(std::span<const uint8_t> frame) {
+  if (frame.size() < sizeof(net::ethernet::Header))
+    return recorder::Reason::Truncated;
+
+  auto type = net::ethernet::to_type((frame[12] << 8) | frame[13]);
+  if (type == net::ethernet::PacketType::Unknown)
+    return recorder::Reason::UnsupportedType;
+  if (type == net::ethernet::PacketType::ARP ||
+      frame.size() < net::ethernet::classify::IPV4_FRAME_SIZE)
+    return recorder::Reason::Truncated;
+  return recorder::Reason::BadIPv4;
+}
+
+std::size_t Stack::add_interface(Link &link, uint32_t ip_address,
+                                 uint8_t prefix_length,
+                                 std::array<uint8_t, 6> mac) {
+  auto index = _interfaces.size();
+  _interfaces.push_back({&link, ip_address, prefix_length, mac});
+  _addresses.push_back(ip_address);
+
+  auto &interface = _interfaces.back();
+  _routes.push_back(
+      {ip_address & interface.netmask(), prefix_length, 0, index});
+  LOG_INFO("Interface {} is {}/{}", link.get_name(),
+           net::ethernet::ipv4::ip_to_string(ip_address), prefix_length);
+  return index;
+}
+
+void Stack::add_route(uint32_t network, uint8_t prefix_length,
+                      uint32_t gateway) {
+  auto *route = lookup(gateway);
+  if (!route || route->gateway) {
+    throw std::invalid_argument(
+        std::format("gateway {} is not on a connected network",
+                    net::ethernet::ipv4::ip_to_string(gateway)));
+  }
+
+  network &= net::ethernet::ipv4::prefix_to_netmask(prefix_length);
+  _routes.push_back({network, prefix_length, gateway, route->interface});
+  LOG_INFO("Route {}/{} via {}", net::ethernet::ipv4::ip_to_string(network),
+           prefix_length, net::ethernet::ipv4::ip_to_string(gateway));
+}
+
+void Stack::add_neighbor(uint32_t ip_address, std::array<uint8_t, 6> mac) {
+  _neighbors[ip_address] = mac;
+}
+
+void Stack::set_forwarding(bool enabled) { _forwarding = enabled; }
+
+void Stack::attach(ShmServer &server) { _server = &server; }
+
+const std::vector<Interface> &Stack::interfaces() const { return _interfaces; }
+
+void Stack::handle_burst(std::size_t interface,
+                         std::span<std::vector<uint8_t>> frames) {
+  using net::ethernet::classify::Class;
+  _views.assign(frames.begin(), frames.end());
+  for (auto frame : _views) {
+    recorder::rx(frame);
+  }
+  net::ethernet::classify::classify(_views, _addresses, _classes);
+
+  // Past classification the EtherType is known to be supported, so the
+  // ethernet header can be taken as is.
+  auto ethernet = [this](uint16_t index, std::span<const uint8_t> &packet) {
+    return *net::ethernet::parse(_views[index], packet);
+  };
+
+  std::span<const uint8_t> packet;
+  for (auto index : _classes[Class::ARP]) {
+    auto ethernet_header = ethernet(index, packet);
+    handle_arp(_views[index], ethernet_header, packet, interface);
+  }
+  for (auto type : {Class::ICMP, Class::Local, Class::Fragment}) {
+    for (auto index : _classes[type]) {
+      auto ethernet_header = ethernet(index, packet);
+      handle_ipv4(_views[index], ethernet_header, packet, interface);
+    }
+  }
+  for (auto index : _classes[Class::Drop]) {
+    recorder::drop(drop_reason(_views[index]), _views[index]);
+  }
+  // Last, as forwarding hands the frame buffers over to the outgoing links.
+  for (auto index : _classes[Class::Forward]) {
+    if (_forwarding) {
+      forward(frames[index], interface);
+    } else {
+      recorder::drop(recorder::Reason::NotForUs, _views[index]);
+    }
+  }
+
+  LOG_TRACE("Burst of {}: {} ARP, {} ICMP, {} not for us, {} dropped",
+            frames.size(), _classes[Class::ARP].size(),
+            _classes[Class::ICMP].size(), _classes[Class::Forward].size(),
+            _classes[Class::Drop].size());
+}
+
+void Stack::forward(std::vector<uint8_t> &frame, std::size_t interface) {
+  // Only frames addressed to the ingress interface are routed, so a frame
+  // flooded to us by a switch is not forwarded a second time.
+  const auto &mac = _interfaces[interface].mac;
+  if (!std::equal(mac.begin(), mac.end(), frame.begin())) {
+    recorder::drop(recorder::Reason::NotForUs, frame);
+    return;
+  }
+
+  uint8_t *ipv4 = frame.data() + sizeof(net::ethernet::Header);
+  std::size_t header_length = (ipv4[0] & 0x0f) * 4;
+  if (frame.size() < sizeof(net::ethernet::Header) + header_length) {
+    recorder::drop(recorder::Reason::Truncated, frame);
+    return;
+  }
+  if (net::ethernet::ipv4::calculate_checksum({ipv4, header_length}) != 0) {
+    recorder::drop(recorder::Reason::BadIPv4, frame);
+    return;
+  }
+
+  uint32_t destination =
+      (ipv4[16] << 24) | (ipv4[17] << 16) | (ipv4[18] << 8) | ipv4[19];
+  // Neither limited broadcast nor multicast is routed.
+  if (destination == 0xffffffff || (destination >> 28) == 0xe) {
+    recorder::drop(recorder::Reason::NotForUs, frame);
+    return;
+  }
+
+  auto *route = lookup(destination);
+  if (!route) {
+    LOG_DEBUG("No route to {}",
+              net::ethernet::ipv4::ip_to_string(destination));
+    recorder::drop(recorder::Reason::NoRoute, frame);
+    return;
+  }
+
+  auto &time_to_live = ipv4[8];
+  if (time_to_live <= 1) {
+    recorder::drop(recorder::Reason::TTLExceeded, frame);
+    if (may_send_icmp_error(frame, interface)) {
+      send_time_exceeded(frame, interface);
+    }
+    return;
+  }
+
+  // TTL shares a checksummed word with the protocol.
+  uint16_t old_word = (time_to_live << 8) | ipv4[9];
+  time_to_live--;
+  uint16_t new_word = (time_to_live << 8) | ipv4[9];
+  auto checksum = net::ethernet::ipv4::update_checksum(
+      (ipv4[10] << 8) | ipv4[11], old_word, new_word);
+  ipv4[10] = (checksum >> 8) & 0xff;
+  ipv4[11] = checksum & 0xff;
+
+  auto next_hop = route->gateway ? route->gateway : destination;
+  auto neighbor = _neighbors.find(next_hop);
+  if (neighbor == _neighbors.end()) {
+    // Held until the neighbor answers, up to a few frames per next hop.
+    auto *pending = resolve(next_hop, route->interface);
+    if (!pending || pending->frames.size() >= PENDING_FRAMES) {
+      recorder::drop(recorder::Reason::NoNeighbor, frame);
+      return;
+    }
+    pending->frames.push_back(std::move(frame));
+    return;
+  }
+
+  transmit(frame, route->interface, neighbor->second);
+}
+
+void Stack::transmit(std::vector<uint8_t> &frame, std::size_t interface,
+                     const std::array<uint8_t, 6> &mac) {
+  auto &out = _interfaces[interface];
+  std::memcpy(frame.data(), mac.data(), 6);
+  std::memcpy(frame.data() + 6, out.mac.data(), 6);
+
+  recorder::decision(recorder::Reason::Forwarded, frame);
+  recorder::tx(frame);
+  if (out.link->transmit(std::move(frame)) == 0) {
+    recorder::drop(recorder::Reason::LinkFull, frame);
+  }
+}
+
+Stack::PendingNeighbor *Stack::resolve(uint32_t ip_address,
+                                       std::size_t interface) {
+  auto now = std::chrono::steady_clock::now();
+  auto pending = _pending.find(ip_address);
+  if (pending == _pending.end()) {
+    if (_pending.size() >= MAX_PENDING) {
+      // Make room by giving up on addresses that didn't answer in time.
+      for (auto it = _pending.begin(); it != _pending.end();) {
+        if (now - it->second.requested < ARP_RETRY_INTERVAL) {
+          ++it;
+          continue;
+        }
+        for (const auto &frame : it->second.frames) {
+          recorder::drop(recorder::Reason::NoNeighbor, frame);
+        }
+        it = _pending.erase(it);
+      }
+      if (_pending.size() >= MAX_PENDING) {
+        return nullptr;
+      }
+    }
+
+    pending = _pending.emplace(ip_address, PendingNeighbor{now, {}}).first;
+    send_arp_request(ip_address, interface);
+  } else if (now - pending->second.requested >= ARP_RETRY_INTERVAL) {
+    // Whatever is still queued has waited a whole interval already.
+    for (const auto &frame : pending->second.frames) {
+      recorder::drop(recorder::Reason::NoNeighbor, frame);
+    }
+    pending->second.frames.clear();
+    pending->second.requested = now;
+    send_arp_request(ip_address, interface);
+  }
+  return &pending->second;
+}
+
+std::size_t Stack::send_ipv4(uint32_t destination, uint8_t protocol,
+                             std::span<const uint8_t> payload) {
+  auto *route = lookup(destination);
+  if (!route) {
+    LOG_DEBUG("No route to {}",
+              net::ethernet::ipv4::ip_to_string(destination));
+    return 0;
+  }
+
+  auto &out = _interfaces[route->interface];
+  // Nothing is fragmented, so larger payloads cannot be sent at all.
+  if (20 + payload.size() > static_cast<std::size_t>(out.link->get_mtu())) {
+    LOG_DEBUG("Payload of {} bytes exceeds the MTU of {}", payload.size(),
+              out.link->get_name());
+    return 0;
+  }
+
+  auto next_hop = route->gateway ? route->gateway : destination;
+  auto neighbor = _neighbors.find(next_hop);
+  if (neighbor == _neighbors.end()) {
+    resolve(next_hop, route->interface);
+    return 0;
+  }
+
+  auto ipv4_header = net::ethernet::ipv4::Header();
+  ipv4_header.internet_header_length = 5;
+  ipv4_header.version = 4;
+  ipv4_header.protocol =
+      static_cast<net::ethernet::ipv4::Protocol>(protocol);
+  ipv4_header.type_of_service = 0;
+  ipv4_header.identification = 0;
+  ipv4_header.flags = 0;
+  ipv4_header.fragment_offset = 0;
+  ipv4_header.time_to_live = 64;
+  ipv4_header.source = out.ip_address;
+  ipv4_header.destination = destination;
+  ipv4_header.length = 20 + payload.size();
+  ipv4_header.checksum = 0;
+
+  std::vector<uint8_t> ipv4_packet;
+  net::ethernet::ipv4::build(ipv4_header, payload, ipv4_packet);
+
+  auto ethernet_header = net::ethernet::Header();
+  ethernet_header.type = net::ethernet::PacketType::IPv4;
+  ethernet_header.src_mac = out.mac;
+  ethernet_header.dst_mac = neighbor->second;
+
+  net::ethernet::build(ethernet_header, ipv4_packet, _reply);
+  return send(route->interface);
+}
+
+const Route *Stack::lookup(uint32_t destination) const {
+  const Route *best = nullptr;
+  for (const auto &route : _routes) {
+    auto netmask = net::ethernet::ipv4::prefix_to_netmask(route.prefix_length);
+    if ((destination & netmask) == route.network &&
+        (!best || route.prefix_length > best->prefix_length)) {
+      best = &route;
+    }
+  }
+  return best;
+}
+
+void Stack::send_arp_request(uint32_t ip_address, std::size_t interface) {
+  auto &out = _interfaces[interface];
+
+  auto request_header = net::ethernet::arp::Header();
+  request_header.hardware_type = 0x0001;
+  request_header.protocol_type = 0x0800;
+  request_header.hardware_length = 0x06;
+  request_header.protocol_length = 0x04;
+  request_header.opcode = 0x01;
+  request_header.source_mac_address = out.mac;
+  request_header.source_ip = out.ip_address;
+  request_header.destination_mac_address = {};
+  request_header.destination_ip = ip_address;
+  LOG_DEBUG("ARP request: {}", request_header.to_string());
+
+  std::vector<uint8_t> request_arp_packet;
+  net::ethernet::arp::build(request_header, request_arp_packet);
+
+  auto request_ethernet_header = net::ethernet::Header();
+  request_ethernet_header.type = net::ethernet::PacketType::ARP;
+  request_ethernet_header.src_mac = out.mac;
+  request_ethernet_header.dst_mac = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+  net::ethernet::build(request_ethernet_header, request_arp_packet, _reply);
+  send(interface);
+}
+
+// RFC 1812 4.3.2.7: no ICMP errors about ICMP errors, non-initial fragments,
+// link-layer broadcasts or packets whose source doesn't name a single host.
+bool Stack::may_send_icmp_error(std::span<const uint8_t> frame,
+                                std::size_t interface) const {
+  if (frame[0] & 0x01) {
+    return false;
+  }
+
+  auto ipv4 = frame.subspan(sizeof(net::ethernet::Header));
+  std::size_t header_length = (ipv4[0] & 0x0f) * 4;
+  if ((ipv4[6] & 0x1f) | ipv4[7]) {
+    return false;
+  }
+
+  uint32_t source =
+      (ipv4[12] << 24) | (ipv4[13] << 16) | (ipv4[14] << 8) | ipv4[15];
+  auto netmask = _interfaces[interface].netmask();
+  auto network = _interfaces[interface].ip_address & netmask;
+  bool directed_broadcast = netmask < 0xfffffffe &&
+                            (source & netmask) == network &&
+                            (source | netmask) == 0xffffffff;
+  // Zero network, loopback, multicast and class E (including broadcast).
+  if ((source >> 24) == 0 || (source >> 24) == 127 || (source >> 28) >= 0xe ||
+      directed_broadcast) {
+    return false;
+  }
+
+  if (ipv4[9] == 0x01 && ipv4.size() > header_length) {
+    switch (ipv4[header_length]) {
+    case 0x03: // Destination Unreachable
+    case 0x04: // Source Quench
+    case 0x05: // Redirect
+    case 0x0B: // Time Exceeded
+    case 0x0C: // Parameter Problem
+      return false;
+    }
+  }
+  return true;
+}
+
+void Stack::send_time_exceeded(std::span<const uint8_t> frame,
+                               std::size_t interface) {
+  auto &in = _interfaces[interface];
+  auto ipv4 = frame.subspan(sizeof(net::ethernet::Header));
+  std::size_t header_length = (ipv4[0] & 0x0f) * 4;
+  uint32_t source =
+      (ipv4[12] << 24) | (ipv4[13] << 16) | (ipv4[14] << 8) | ipv4[15];
+
+  // The original IP header and the first 8 bytes of its data.
+  auto icmp_data = ipv4.first(std::min(ipv4.size(), header_length + 8));
+
+  auto icmp_header = net::ethernet::ipv4::icmp::Header();
+  icmp_header.type = net::ethernet::ipv4::icmp::PacketType::TimeExceeded;
+  icmp_header.code = 0;
+  icmp_header.identifier = 0;
+  icmp_header.sequence_number = 0;
+  icmp_header.checksum = 0;
+
+  std::vector<uint8_t> icmp_packet;
+  net::ethernet::ipv4::icmp::build(icmp_header, icmp_data, icmp_packet);
+  LOG_DEBUG("ICMP time exceeded: {}", icmp_header.to_string());
+
+  auto ipv4_header = net::ethernet::ipv4::Header();
+  ipv4_header.internet_header_length = 5;
+  ipv4_header.version = 4;
+  ipv4_header.protocol = net::ethernet::ipv4::Protocol::ICMP;
+  ipv4_header.type_of_service = 0;
+  ipv4_header.identification = 0;
+  ipv4_header.flags = 0;
+  ipv4_header.fragment_offset = 0;
+  ipv4_header.time_to_live = 64;
+  ipv4_header.source = in.ip_address;
+  ipv4_header.destination = source;
+  ipv4_header.length = 20 + icmp_packet.size();
+  ipv4_header.checksum = 0;
+
+  std::vector<uint8_t> ipv4_packet;
+  net::ethernet::ipv4::build(ipv4_header, icmp_packet, ipv4_packet);
+
+  auto ethernet_header = net::ethernet::Header();
+  ethernet_header.type = net::ethernet::PacketType::IPv4;
+  ethernet_header.src_mac = in.mac;
+  std::memcpy(ethernet_header.dst_mac.data(), frame.data() + 6, 6);
+
+  net::ethernet::build(ethernet_header, ipv4_packet, _reply);
+  send(interface);
+}
+
+std::size_t Stack::send(std::size_t interface) {
+  recorder::tx(_reply);
+  auto n = _interfaces[interface].link->write(_reply);
+  if (n == 0) {
+    recorder::drop(recorder::Reason::LinkFull, _reply);
+  }
+  return n;
+}
+
+void Stack::handle_arp(std::span<const uint8_t> frame,
+                       const net::ethernet::Header &ethernet_header,
+                       std::span<const uint8_t> packet,
+                       std::size_t interface) {
+  auto arp_header = net::ethernet::arp::parse(packet);
+  if (!arp_header) {
+    recorder::drop(recorder::Reason::BadARP, frame);
+    return;
+  }
+
+  LOG_INFO("ARP packet received");
+  LOG_DEBUG("ARP Header: {}", arp_header->to_string());
+
+  // Requests and replies alike tell us where their sender is.
+  // The header is packed, so copy the address out before using it as a key.
+  auto &in = _interfaces[interface];
+  uint32_t sender = arp_header->source_ip;
+  if ((sender & in.netmask()) == (in.ip_address & in.netmask())) {
+    std::array<uint8_t, 6> mac = arp_header->source_mac_address;
+    _neighbors[sender] = mac;
+
+    auto pending = _pending.find(sender);
+    if (pending != _pending.end()) {
+      auto frames = std::move(pending->second.frames);
+      _pending.erase(pending);
+      for (auto &queued : frames) {
+        transmit(queued, interface, mac);
+      }
+    }
+  }
+
+  if (arp_header->opcode != 1 ||
+      arp_header->destination_ip != in.ip_address) {
+    recorder::drop(recorder::Reason::NotForUs, frame);
+    return;
+  }
+  recorder::decision(recorder::Reason::ARPReply, frame);
+
+  auto reply_header = net::ethernet::arp::Header();
+  reply_header.hardware_type = 0x0001;
+  reply_header.protocol_type = 0x0800;
+  reply_header.hardware_length = 0x06;
+  reply_header.protocol_length = 0x04;
+  reply_header.opcode = 0x02;
+  reply_header.source_mac_address = in.mac;
+  reply_header.source_ip = arp_header->destination_ip;
+  reply_header.destination_mac_address = arp_header->source_mac_address;
+  reply_header.destination_ip = arp_header->source_ip;
+  LOG_DEBUG("ARP reply: {}", reply_header.to_string());
+
+  std::vector<uint8_t> reply_arp_packet;
+  net::ethernet::arp::build(reply_header, reply_arp_packet);
+  LOG_TRACE("Successfully built ARP reply (size {})", reply_arp_packet.size());
+
+  auto reply_ethernet_header = net::ethernet::Header();
+  reply_ethernet_header.type = net::ethernet::PacketType::ARP;
+  reply_ethernet_header.src_mac = in.mac;
+  reply_ethernet_header.dst_mac = ethernet_header.src_mac;
+  LOG_DEBUG("ARP reply ethernet: {}", reply_ethernet_header.to_string());
+
+  net::ethernet::build(reply_ethernet_header, reply_arp_packet, _reply);
+  LOG_TRACE("Successfully built ARP ethernet reply (size {})", _reply.size());
+  auto n = send(interface);
+  LOG_DEBUG("Successfully sent ARP reply: {}", n);
+}
+
+void Stack::handle_ipv4(std::span<const uint8_t> frame,
+                        const net::ethernet::Header &ethernet_header,
+                        std::span<const uint8_t> packet,
+                        std::size_t interface) {
+  std::span<const uint8_t> ipv4_data;
+  auto ipv4_header = net::ethernet::ipv4::parse(packet, ipv4_data);
+  if (!ipv4_header) {
+    recorder::drop(recorder::Reason::BadIPv4, frame);
+    return;
+  }
+
+  LOG_INFO("IPv4 packet received");
+  LOG_DEBUG("IPv4 Header: {}", ipv4_header->to_string());
+  switch (ipv4_header->protocol) {
+  case net::ethernet::ipv4::Protocol::ICMP: {
+    std::span<const uint8_t> icmp_data;
+
+    auto icmp_header = net::ethernet::ipv4::icmp::parse(ipv4_data, icmp_data);
+    if (!icmp_header) {
+      recorder::drop(recorder::Reason::BadICMP, frame);
+      return;
+    }
+
+    LOG_INFO("ICMP packet received");
+    LOG_DEBUG("ICMP Header: {}", icmp_header->to_string());
+
+    if (icmp_header->type != net::ethernet::ipv4::icmp::PacketType::Echo) {
+      if (_server && _server->deliver(packet)) {
+        recorder::decision(recorder::Reason::Delivered, frame);
+        return;
+      }
+      recorder::drop(recorder::Reason::UnsupportedProtocol, frame);
+      return;
+    }
+    recorder::decision(recorder::Reason::EchoReply, frame);
+
+    auto icmp_reply_header = net::ethernet::ipv4::icmp::Header();
+    icmp_reply_header.type = net::ethernet::ipv4::icmp::PacketType::Reply;
+    icmp_reply_header.code = 0;
+    icmp_reply_header.identifier = icmp_header->identifier;
+    icmp_reply_header.sequence_number = icmp_header->sequence_number;
+    icmp_reply_header.checksum = 0;
+
+    std::vector<uint8_t> icmp_reply_packet;
+    net::ethernet::ipv4::icmp::build(icmp_reply_header, icmp_data,
+                                     icmp_reply_packet);
+    LOG_DEBUG("ICMP reply: {}", icmp_reply_header.to_string());
+
+    auto ipv4_reply_header = net::ethernet::ipv4::Header();
+    ipv4_reply_header.internet_header_length = 5;
+    ipv4_reply_header.version = 4;
+    ipv4_reply_header.protocol = net::ethernet::ipv4::Protocol::ICMP;
+    ipv4_reply_header.type_of_service = 0;
+    ipv4_reply_header.identification = ipv4_header->identification + 1;
+    ipv4_reply_header.flags = 0;
+    ipv4_reply_header.fragment_offset = 0;
+    ipv4_reply_header.time_to_live = 64;
+    ipv4_reply_header.source = ipv4_header->destination;
+    ipv4_reply_header.destination = ipv4_header->source;
+    ipv4_reply_header.length = 20 + icmp_reply_packet.size();
+    ipv4_reply_header.checksum = 0;
+
+    std::vector<uint8_t> ipv4_reply_packet;
+    net::ethernet::ipv4::build(ipv4_reply_header, icmp_reply_packet,
+                               ipv4_reply_packet);
+    LOG_DEBUG("IPv4 reply: {}", ipv4_reply_header.to_string());
+
+    auto ethernet_reply_header = net::ethernet::Header();
+    ethernet_reply_header.type = net::ethernet::PacketType::IPv4;
+    ethernet_reply_header.src_mac = _interfaces[interface].mac;
+    ethernet_reply_header.dst_mac = ethernet_header.src_mac;
+
+    net::ethernet::build(ethernet_reply_header, ipv4_reply_packet, _reply);
+    LOG_DEBUG("Ethernet reply: {}", ethernet_reply_header.to_string());
+
+    send(interface);
+    break;
+  }
+  default:
+    if (_server && _server->deliver(packet)) {
+      recorder::decision(recorder::Reason::Delivered, frame);
+      break;
+    }
+    recorder::drop(recorder::Reason::UnsupportedProtocol, frame);
+    LOG_WARN("IPv4 protocol {} not supported",
+             net::ethernet::ipv4::protocol_to_string(ipv4_header->protocol));
+    break;
+  }
+}
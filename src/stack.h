@@ -0,0 +1,110 @@
+#pragma once
+#include "link.h"
+#include "net/classify.h"
+#include "net/ethernet.h"
+#include "net/ipv4.h"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+class ShmServer;
+
+struct Interface {
+  Link *link;
+  uint32_t ip_address;
+  uint8_t prefix_length;
+  std::array<uint8_t, 6> mac;
+
+  uint32_t netmask() const {
+    return net::ethernet::ipv4::prefix_to_netmask(prefix_length);
+  }
+};
+
+struct Route {
+  uint32_t network;
+  uint8_t prefix_length;
+  // 0 for directly connected networks.
+  uint32_t gateway;
+  std::size_t interface;
+};
+
+// Answers ARP and ICMP echo requests addressed to any of its interfaces and,
+// when forwarding is enabled, routes other IPv4 traffic between them.
+class Stack {
+public:
+  // Adds an interface and a connected route for its network; returns its
+  // index.
+  std::size_t add_interface(Link &link, uint32_t ip_address,
+                            uint8_t prefix_length, std::array<uint8_t, 6> mac);
+  // Routes `network` through `gateway`, which must be on a connected network.
+  void add_route(uint32_t network, uint8_t prefix_length, uint32_t gateway);
+  void add_neighbor(uint32_t ip_address, std::array<uint8_t, 6> mac);
+  void set_forwarding(bool enabled);
+  // Hands IPv4 payloads matching an application's registration to it instead
+  // of the built-in handlers. ICMP echo requests are always answered here.
+  void attach(ShmServer &server);
+
+  const std::vector<Interface> &interfaces() const;
+
+  // Classifies a burst received on an interface up front and then handles it
+  // one class at a time. Forwarded frames are rewritten in place and handed
+  // to the outgoing link, leaving their buffer empty.
+  void handle_burst(std::size_t interface,
+                    std::span<std::vector<uint8_t>> frames);
+
+  // Sends `payload` to `destination` from the address of the interface it is
+  // routed through. Dropped if it does not fit the interface's MTU, or, after
+  // asking for the next hop (rate-limited), if its MAC address isn't known
+  // yet.
+  std::size_t send_ipv4(uint32_t destination, uint8_t protocol,
+                        std::span<const uint8_t> payload);
+
+private:
+  void handle_arp(std::span<const uint8_t> frame,
+                  const net::ethernet::Header &ethernet_header,
+                  std::span<const uint8_t> packet, std::size_t interface);
+  void handle_ipv4(std::span<const uint8_t> frame,
+                   const net::ethernet::Header &ethernet_header,
+                   std::span<const uint8_t> packet, std::size_t interface);
+  void forward(std::vector<uint8_t> &frame, std::size_t interface);
+  // Hands a forwarded frame to the link of `interface`, addressed to `mac`.
+  void transmit(std::vector<uint8_t> &frame, std::size_t interface,
+                const std::array<uint8_t, 6> &mac);
+
+  // A next hop whose MAC address was asked for, with the frames waiting on it.
+  struct PendingNeighbor {
+    std::chrono::steady_clock::time_point requested;
+    std::vector<std::vector<uint8_t>> frames;
+  };
+  static constexpr std::size_t PENDING_FRAMES = 4;
+  static constexpr std::size_t MAX_PENDING = 256;
+  static constexpr std::chrono::seconds ARP_RETRY_INTERVAL{1};
+
+  const Route *lookup(uint32_t destination) const;
+  // Sends an ARP request for `ip_address` unless one went out less than
+  // ARP_RETRY_INTERVAL ago. Returns nullptr when too many addresses are
+  // already being resolved.
+  PendingNeighbor *resolve(uint32_t ip_address, std::size_t interface);
+  void send_arp_request(uint32_t ip_address, std::size_t interface);
+  bool may_send_icmp_error(std::span<const uint8_t> frame,
+                           std::size_t interface) const;
+  void send_time_exceeded(std::span<const uint8_t> frame,
+                          std::size_t interface);
+  std::size_t send(std::size_t interface);
+
+  std::vector<Interface> _interfaces;
+  std::vector<uint32_t> _addresses;
+  std::vector<Route> _routes;
+  std::unordered_map<uint32_t, std::array<uint8_t, 6>> _neighbors;
+  std::unordered_map<uint32_t, PendingNeighbor> _pending;
+  bool _forwarding{false};
+  ShmServer *_server{nullptr};
+
+  std::vector<uint8_t> _reply;
+  std::vector<std::span<const uint8_t>> _views;
+  net::ethernet::classify::Result _classes;
+};
@@ -1,5 +1,6 @@
 #include "tun.h"
 #include "log.h"
+#include "net/ethernet.h"
 #include "utils.h"
 #include <array>
 #include <cerrno>
@@ -7,12 +8,15 @@
 #include <fcntl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <poll.h>
 #include <stdexcept>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
-TunDevice::TunDevice(std::string if_name, int mtu)
-    : _if_name(std::move(if_name)), _mtu(mtu) {}
+TunDevice::TunDevice(std::string if_name, int mtu, std::string network,
+                     std::string address)
+    : _if_name(std::move(if_name)), _mtu(mtu), _network(std::move(network)),
+      _address(std::move(address)) {}
 
 TunDevice::~TunDevice() {
   if (_fd >= 0) {
@@ -25,7 +29,7 @@ void TunDevice::open() {
     throw std::runtime_error("TUN device already open");
   }
 
-  _fd = ::open("/dev/net/tun", O_RDWR);
+  _fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK);
   if (_fd < 0) {
     throw std::runtime_error("Failed to open TUN device: " +
                              std::string(::strerror(errno)));
@@ -45,16 +49,31 @@ void TunDevice::open() {
   LOG_DEBUG("Interface {} attached to fd {}", _if_name, _fd);
 
   utils::cmd("ip link set dev {} up", _if_name);
-  utils::cmd("ip route add {} dev {}", "10.10.10.0/24", _if_name);
-  utils::cmd("ip addr add {} dev {}", "10.10.10.1", _if_name); //
+  utils::cmd("ip route add {} dev {}", _network, _if_name);
+  utils::cmd("ip addr add {} dev {}", _address, _if_name);
 
   LOG_DEBUG("Interface {} initialized", _if_name);
 }
 
 std::size_t TunDevice::read(std::vector<uint8_t> &buffer) {
-  buffer.resize(_mtu);
+  std::size_t n;
+  while ((n = try_read(buffer)) == 0) {
+    wait(std::chrono::milliseconds(-1));
+  }
+
+  return n;
+}
+
+std::size_t TunDevice::try_read(std::vector<uint8_t> &buffer) {
+  // The MTU covers the IPv4 packet, the TAP device also hands us its
+  // ethernet header.
+  buffer.resize(_mtu + sizeof(net::ethernet::Header));
   auto n = ::read(_fd, buffer.data(), buffer.size());
   if (n < 0) {
+    buffer.clear();
+    if (errno == EAGAIN || errno == EINTR) {
+      return 0;
+    }
     throw std::runtime_error("read failed: " + std::string(::strerror(errno)));
   }
   buffer.resize(n);
@@ -73,8 +92,22 @@ std::size_t TunDevice::write(const std::vector<uint8_t> &buffer) {
   return static_cast<std::size_t>(n);
 }
 
+bool TunDevice::wait(std::chrono::milliseconds timeout) {
+  struct pollfd pfd = {.fd = _fd, .events = POLLIN, .revents = 0};
+  auto n = ::poll(&pfd, 1, static_cast<int>(timeout.count()));
+  if (n < 0 && errno != EINTR) {
+    throw std::runtime_error("poll failed: " + std::string(::strerror(errno)));
+  }
+
+  return n > 0 && (pfd.revents & POLLIN);
+}
+
+int TunDevice::get_fd() const { return _fd; }
+
 std::string TunDevice::get_name() const { return _if_name; }
 
+int TunDevice::get_mtu() const { return _mtu; }
+
 std::array<uint8_t, 6> TunDevice::get_mac() const {
   int s = socket(AF_INET, SOCK_DGRAM, 0);
   if (s < 0)
@@ -1,24 +1,36 @@
 #pragma once
+#include "link.h"
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <string>
 #include <vector>
 
-class TunDevice {
+class TunDevice : public Link {
 public:
-  explicit TunDevice(std::string if_name, int mtu = 1500);
-  ~TunDevice();
+  // `network` is routed through the interface and `address` assigned to the
+  // host side of it.
+  explicit TunDevice(std::string if_name, int mtu = 1500,
+                     std::string network = "10.10.10.0/24",
+                     std::string address = "10.10.10.1");
+  ~TunDevice() override;
 
   void open();
 
-  std::string get_name() const;
+  std::string get_name() const override;
+  int get_mtu() const override;
   std::array<uint8_t, 6> get_mac() const;
 
-  std::size_t read(std::vector<uint8_t> &buffer);
-  std::size_t write(const std::vector<uint8_t> &buffer);
+  std::size_t read(std::vector<uint8_t> &buffer) override;
+  std::size_t write(const std::vector<uint8_t> &buffer) override;
+  std::size_t try_read(std::vector<uint8_t> &buffer) override;
+  bool wait(std::chrono::milliseconds timeout) override;
+  int get_fd() const override;
 
 private:
   int _fd{-1};
   std::string _if_name;
   int _mtu;
+  std::string _network;
+  std::string _address;
 };